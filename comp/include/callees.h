@@ -0,0 +1,47 @@
+#pragma once
+
+#include <bitset>
+#include "inst_info.h"
+#include "register.h"
+
+namespace lama::rv {
+
+using RegisterSet = std::bitset<32>;
+
+// Runtime functions the generated code calls: name, whether the collector may run
+#define RUNTIME_FUNCTIONS(MACRO)    \
+    MACRO(Lread, false)             \
+    MACRO(Lwrite, false)            \
+    MACRO(Llength, false)           \
+    MACRO(RVLstring, true)          \
+    MACRO(RVBstring, true)          \
+    MACRO(RVBarray, true)           \
+    MACRO(RVBsexp, true)            \
+    MACRO(RVBclosure, true)         \
+    MACRO(Belem, false)             \
+    MACRO(Bsta, false)              \
+    MACRO(Btag, false)              \
+    MACRO(Barray_patt, false)       \
+    MACRO(Bstring_patt, false)      \
+    MACRO(Bclosure_tag_patt, false) \
+    MACRO(Bboxed_patt, false)       \
+    MACRO(Bunboxed_patt, false)     \
+    MACRO(Barray_tag_patt, false)   \
+    MACRO(Bstring_tag_patt, false)  \
+    MACRO(Bsexp_tag_patt, false)    \
+    MACRO(Bmatch_failure, false)
+
+// What a call does to the registers of its caller
+struct CalleeEffects {
+    // Registers the callee may change
+    RegisterSet clobbers;
+    // The collector may run while the callee-saved registers are only saved in a frame it
+    // does not scan, so live ones must be saved by the caller, and the values of its callers
+    // by its prologue
+    bool may_collect;
+};
+
+// Unknown runtime functions are assumed to clobber everything the ABI allows and to collect
+CalleeEffects callee_effects(Callee const& callee);
+
+}  // namespace lama::rv
@@ -4,7 +4,13 @@
 #include <ostream>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
+#include <algorithm>
 
+#include "elf_writer.h"
+#include "insn.h"
+#include "peephole.h"
 #include "symb_stack.h"
 #include "register.h"
 
@@ -13,60 +19,67 @@ namespace lama::rv {
     class CodeBuffer {
         private:
         std::ostream& out_;
+        OutputFormat format_;
+        TargetFeatures target_;
+        std::vector<Item> items_;
+        PeepholeStats peephole_stats_{};
+        // Labels the functions start at, and their sizes once flushed if they are measured
+        std::vector<std::string> functions_;
+        bool measure_code_size_ = false;
+        CodeSizes code_sizes_{};
         public:
-        CodeBuffer(std::ostream& os): out_(os) {};
+        CodeBuffer(std::ostream& os, OutputFormat format = OutputFormat::Asm, TargetFeatures target = {})
+            : out_(os), format_(format), target_(target) {};
 
         using SymbolicLocation = SymbolicStack::Loc;
 
         // insn reg_dest, reg_src1, reg_src1
-        #define R_TYPE(rv_insn) \
+        #define R_TYPE(name, rv_insn, ...) \
             void emit_ ## rv_insn (const Register& dst, const Register& src1, const Register& src2) { \
-                emit_r_type(#rv_insn, dst, src1, src2); \
+                emit_r_type(Op::name, dst, src1, src2); \
             } \
             void symb_emit_ ## rv_insn (const SymbolicLocation& dst, const SymbolicLocation& src1, const SymbolicLocation& src2) { \
-                symb_emit_r_type(#rv_insn, dst, src1, src2); \
+                symb_emit_r_type(Op::name, dst, src1, src2); \
             } \
 
         // insn reg_dest, reg_src, immediate
-        #define I_TYPE(rv_insn) \
+        #define I_TYPE(name, rv_insn, ...) \
             void emit_ ## rv_insn (const Register& dst, const Register& src, int imm) { \
-                emit_i_type(#rv_insn, dst, src, imm); \
+                emit_i_type(Op::name, dst, src, imm); \
             } \
             void symb_emit_ ## rv_insn (const SymbolicLocation& dst, const SymbolicLocation& src, int imm) { \
-                symb_emit_i_type(#rv_insn, dst, src, imm); \
+                symb_emit_i_type(Op::name, dst, src, imm); \
             }
 
         // insn reg_dest, base_reg(immediate)
-        #define S_TYPE(rv_insn) \
+        #define S_TYPE(name, rv_insn, ...) \
             void emit_ ## rv_insn (const Register& dst, const Register& base, int off) { \
-                emit_s_type(#rv_insn, dst, base, off); \
+                emit_s_type(Op::name, dst, base, off); \
             } \
             void symb_emit_ ## rv_insn (const SymbolicLocation& dst, const SymbolicLocation& base, int off) { \
-                symb_emit_s_type(#rv_insn, dst, base, off); \
+                symb_emit_s_type(Op::name, dst, base, off); \
             }
 
         // insn reg_dest, immediate
-        #define U_TYPE(rv_insn) \
-            void emit_ ## rv_insn (const Register& dst, int imm) { \
-                emit_u_type(#rv_insn, dst, imm); \
+        #define U_TYPE(name, rv_insn) \
+            void emit_ ## rv_insn (const Register& dst, int64_t imm) { \
+                emit_u_type(Op::name, dst, imm); \
             } \
-            void symb_emit_ ## rv_insn (const SymbolicLocation& dst, int imm) { \
-                symb_emit_u_type(#rv_insn, dst, imm); \
+            void symb_emit_ ## rv_insn (const SymbolicLocation& dst, int64_t imm) { \
+                symb_emit_u_type(Op::name, dst, imm); \
             }
 
-        #define PSEUDO_TYPE(rv_insn) \
+        #define PSEUDO_TYPE(name, rv_insn) \
             void emit_ ## rv_insn (const Register& dst, const Register& src) { \
-                emit_pseudo_type(#rv_insn, dst, src); \
+                emit_pseudo_type(Op::name, dst, src); \
             } \
             void symb_emit_ ## rv_insn (const SymbolicLocation& dst, const SymbolicLocation& src) { \
-                symb_emit_pseudo_type(#rv_insn, dst, src); \
+                symb_emit_pseudo_type(Op::name, dst, src); \
             }
 
 
-        R_TYPE(add);
-        R_TYPE(sub);
-        R_TYPE(slt);
-        R_TYPE(sgt);
+        RV_R_INSNS(R_TYPE);
+        R_TYPE(Sgt, sgt);
 
         void emit_eq(const Register &dst, const Register &src1, const Register &src2) {
             emit_sub(dst, src2, src1);
@@ -113,158 +126,327 @@ namespace lama::rv {
             symb_emit_xori(dst, dst, 1);
         }
 
+        RV_I_INSNS(I_TYPE);
 
-        R_TYPE(or);
-        R_TYPE(and);
-        R_TYPE(srl); // logical
-        R_TYPE(sra); // arithmetical
-        R_TYPE(sll);
-        R_TYPE(mul);
-        R_TYPE(div);
-        R_TYPE(rem);
+        RV_LOAD_INSNS(S_TYPE);
+        RV_STORE_INSNS(S_TYPE);
 
-        I_TYPE(addi);
-        I_TYPE(slti);
-        I_TYPE(srai);
-        I_TYPE(slli);
-        I_TYPE(ori);
-        I_TYPE(xori);
-        I_TYPE(andi);
+        U_TYPE(Li, li);
 
-        S_TYPE(ld);
-        S_TYPE(sd);
+        PSEUDO_TYPE(Seqz, seqz);
+        PSEUDO_TYPE(Snez, snez);
 
-        U_TYPE(li);
+        #undef R_TYPE
+        #undef I_TYPE
+        #undef S_TYPE
+        #undef U_TYPE
+        #undef PSEUDO_TYPE
 
-        PSEUDO_TYPE(seqz);
-        PSEUDO_TYPE(snez);
+        // dst = (src << shift) + base, in one instruction with Zba; otherwise `temp` holds the
+        // shifted value and may be dst unless dst is base
+        void emit_shift_add(
+            const Register& dst, const Register& src, int shift, const Register& base, const Register& temp
+        ) {
+            if (target_.zba && 1 <= shift && shift <= 3) {
+                static constexpr Op shifted_adds[] = {Op::Sh1add, Op::Sh2add, Op::Sh3add};
+                emit_r_type(shifted_adds[shift - 1], dst, src, base);
+                return;
+            }
+            emit_slli(temp, src, shift);
+            emit_add(dst, temp, base);
+        }
+
+        // dst = a != 0 && b != 0; with Zbb as the unsigned minimum, otherwise clobbering
+        // temp1 and temp2
+        void emit_both_nonzero(const Register& dst, const Register& a, const Register& b) {
+            if (target_.zbb) {
+                emit_minu(dst, a, b);
+                emit_snez(dst, dst);
+                return;
+            }
+            emit_snez(rv::Register::temp1(), a);
+            emit_snez(rv::Register::temp2(), b);
+            emit_and(dst, rv::Register::temp1(), rv::Register::temp2());
+        }
 
         void emit_mv(const Register& dst, const Register& src) {
-            emit_addi(dst, src, 0);
+            emit_pseudo_type(Op::Mv, dst, src);
         }
 
         void symb_emit_mv(const Register& dst_reg, const SymbolicLocation& src) {
-            auto src_reg = to_reg(src, rv::Register::temp2());
-            emit(std::format("mv\t{},\t{}", dst_reg, src_reg));
+            switch (src.type) {
+            case SymbolicStack::LocType::Register:
+                emit_mv(dst_reg, Register{src.number});
+                return;
+            case SymbolicStack::LocType::Memory:
+                emit_ld(dst_reg, rv::Register::fp(), slot_offset(src));
+                return;
+            case SymbolicStack::LocType::Constant:
+                emit_li(dst_reg, src.value);
+                return;
+            }
         }
 
         void symb_emit_mv(const SymbolicLocation& dst, const Register& src_reg) {
-            auto dst_reg = to_reg(dst, rv::Register::temp2());
-            emit(std::format("mv\t{},\t{}", dst_reg, src_reg));
+            switch (dst.type) {
+            case SymbolicStack::LocType::Register:
+                emit_mv(Register{dst.number}, src_reg);
+                return;
+            case SymbolicStack::LocType::Memory:
+                emit_sd(src_reg, rv::Register::fp(), slot_offset(dst));
+                return;
+            case SymbolicStack::LocType::Constant:
+                return;
+            }
         }
 
         void symb_emit_mv(const SymbolicLocation& dst, const SymbolicLocation& src) {
-            auto src_reg = to_reg(src, rv::Register::temp1());
-            auto dst_reg = to_reg(dst, rv::Register::temp2());
-            emit(std::format("mv\t{},\t{}", dst_reg, src_reg));
+            if (dst.type == SymbolicStack::LocType::Register) {
+                symb_emit_mv(Register{dst.number}, src);
+            } else {
+                symb_emit_mv(dst, to_reg(src, rv::Register::temp1()));
+            }
+        }
+
+        // Performs all moves as if simultaneously; destinations must be distinct
+        void symb_emit_parallel_mv(std::vector<std::pair<SymbolicLocation, SymbolicLocation>> moves) {
+            std::erase_if(moves, [](auto const& move) { return move.first == move.second; });
+            while (!moves.empty()) {
+                auto ready = std::ranges::find_if(moves, [&moves](auto const& move) {
+                    return std::ranges::none_of(moves, [&move](auto const& other) {
+                        return other.second == move.first;
+                    });
+                });
+                if (ready == moves.end()) {
+                    // Every destination is still needed as a source: break the cycle through temp2
+                    auto const src = moves.front().second;
+                    symb_emit_mv(rv::Register::temp2(), src);
+                    for (auto& move : moves) {
+                        if (move.second == src) {
+                            move.second = SymbolicLocation::reg(rv::Register::temp2());
+                        }
+                    }
+                    continue;
+                }
+                symb_emit_mv(ready->first, ready->second);
+                moves.erase(ready);
+            }
+        }
+
+        void emit_la(const Register& dst, std::string_view label) {
+            emit_insn({.op = Op::La, .rd = dst, .symbol = std::string{label}});
         }
 
         void symb_emit_la(const SymbolicLocation& dst, std::string_view label) {
-            auto dst_reg = to_reg(dst, rv::Register::temp1());
-            emit(std::format("la\t{},\t{}", dst_reg, label));
+            auto dst_reg = def_reg(dst, rv::Register::temp1());
+            emit_la(dst_reg, label);
+            commit(dst, dst_reg);
+        }
+
+        // sd src, symbol, temp
+        void emit_sd_symbol(const Register& src, std::string_view symbol, const Register& temp) {
+            emit_insn({.op = Op::SdSymbol, .rd = temp, .rs2 = src, .symbol = std::string{symbol}});
         }
 
         void emit_call(std::string_view label) {
-            emit(std::format("call\t{}", label));
+            emit_insn({.op = Op::Call, .symbol = std::string{label}});
+        }
+
+        // Call of the function whose address is in `target`
+        void emit_call_indirect(const Register& target) {
+            emit_insn({.op = Op::Jalr, .rd = rv::Register::ra(), .rs1 = target});
+        }
+
+        // Jump to a function that returns to the current caller
+        void emit_tail(std::string_view label) {
+            emit_insn({.op = Op::Tail, .symbol = std::string{label}});
         }
 
         void emit_ret() {
-            emit("ret");
+            emit_insn({.op = Op::Ret});
         }
 
         void emit_label(std::string_view label) {
-            emit(std::format("{}:", label));
+            items_.emplace_back(Label{std::string{label}});
+        }
+
+        // Records that the function at the already emitted `label` starts here
+        void begin_function(std::string_view label) {
+            functions_.emplace_back(label);
         }
 
         void emit_comment(std::string_view comment) {
-            emit(std::format("# {}", comment));
+            items_.emplace_back(Comment{std::string{comment}});
         }
 
         void emit_j(std::string_view target_label) {
-            emit(std::format("j {}", target_label));
+            emit_insn({.op = Op::J, .symbol = std::string{target_label}});
         }
 
         void emit_cj(bool on_eq, Register const& r1, Register const& r2, std::string_view target_label){
-            emit(
-                std::format(
-                    "{:s}\t{},\t{},\t{}",
-                    on_eq?"beq":"bne",
-                    r1,
-                    r2,
-                    target_label
-                )
-            );
+            emit_branch(on_eq ? Op::Beq : Op::Bne, r1, r2, target_label);
+        }
+
+        void emit_branch(Op op, Register const& r1, Register const& r2, std::string_view target_label) {
+            emit_insn({.op = op, .rs1 = r1, .rs2 = r2, .symbol = std::string{target_label}});
         }
 
+        void emit_section(std::string_view name) {
+            items_.emplace_back(Section{std::string{name}});
+        }
+
+        void emit_global(std::string_view name) {
+            items_.emplace_back(Global{std::string{name}});
+        }
+
+        void emit_fill(size_t count, size_t size, int64_t value) {
+            items_.emplace_back(DataFill{.count = count, .size = size, .value = value});
+        }
+
+        void emit_string(std::string_view value) {
+            items_.emplace_back(DataString{std::string{value}});
+        }
+
+        void emit_align(size_t log2) {
+            items_.emplace_back(DataAlign{log2});
+        }
+
+        void emit_address(std::string_view symbol) {
+            items_.emplace_back(DataAddress{std::string{symbol}});
+        }
+
+        // Register holding the value at `loc`, loaded or materialized into `temp` if needed
         inline Register to_reg(const SymbolicLocation& loc, const Register& temp) {
-            return loc.type == SymbolicStack::LocType::Memory
-                ? emit_ld(temp, rv::Register::sp(), -loc.number * WORD_SIZE), temp
-                : Register{loc.number};
+            if (loc.type == SymbolicStack::LocType::Register) {
+                return Register{loc.number};
+            }
+            symb_emit_mv(temp, loc);
+            return temp;
+        }
+
+        // Register to compute a value for `loc` in; commit() then stores it if `loc` is in memory
+        inline Register def_reg(const SymbolicLocation& loc, const Register& temp) const {
+            return loc.type == SymbolicStack::LocType::Register ? Register{loc.number} : temp;
+        }
+
+        inline void commit(const SymbolicLocation& loc, const Register& reg) {
+            if (loc.type == SymbolicStack::LocType::Memory) {
+                emit_sd(reg, rv::Register::fp(), slot_offset(loc));
+            }
+        }
+
+        static int slot_offset(const SymbolicLocation& loc) {
+            return FrameInfo::offset(loc.number);
+        }
+
+        void emit_insn(Insn insn) {
+            items_.emplace_back(std::move(insn));
+        }
+
+        std::vector<Item> const& items() const {
+            return items_;
+        }
+
+        // Position of the next emitted item
+        size_t position() const {
+            return items_.size();
         }
 
-        void emit(std::string_view str) {
-            out_ << str << std::endl;
+        // Moves the items emitted since `start` to `position`, before the items already there
+        void move_emitted(size_t start, size_t position) {
+            DCHECK_LE(position, start);
+            std::rotate(items_.begin() + position, items_.begin() + start, items_.end());
+        }
+
+        // Runs the peephole optimizer, then writes the buffered program either as assembly
+        // text or as a relocatable object
+        void flush();
+
+        PeepholeStats const& peephole_stats() const {
+            return peephole_stats_;
+        }
+
+        // Makes flush() measure the code of each function with and without the C extension
+        void measure_code_size() {
+            measure_code_size_ = true;
+        }
+
+        CodeSizes const& code_sizes() const {
+            return code_sizes_;
+        }
+
+        TargetFeatures const& target() const {
+            return target_;
         }
 
         private:
 
-        void emit_pseudo_type(const std::string& insn, const Register& dst, const Register& src) {
-            emit(std::format("{}\t{},\t{}", insn, dst, src));
+        void write_asm(std::ostream& os) const;
+
+        void emit_pseudo_type(Op op, const Register& dst, const Register& src) {
+            emit_insn({.op = op, .rd = dst, .rs1 = src});
         }
 
-        void emit_r_type(const std::string& insn, const Register& dst, const Register& src1, const Register& src2) {
-            emit(std::format("{}\t{},\t{},\t{}", insn, dst, src1, src2));
+        void emit_r_type(Op op, const Register& dst, const Register& src1, const Register& src2) {
+            emit_insn({.op = op, .rd = dst, .rs1 = src1, .rs2 = src2});
         }
 
-        void emit_i_type(const std::string& insn, const Register& dst, const Register& src, int imm) {
-            emit(std::format("{}\t{},\t{},\t{}", insn, dst, src, imm));
+        void emit_i_type(Op op, const Register& dst, const Register& src, int imm) {
+            emit_insn({.op = op, .rd = dst, .rs1 = src, .imm = imm});
         }
 
-        void emit_u_type(const std::string& insn, const Register& dst, int imm) {
-            emit(std::format("{}\t{},\t{}", insn, dst, imm));
+        void emit_u_type(Op op, const Register& dst, int64_t imm) {
+            emit_insn({.op = op, .rd = dst, .imm = imm});
         }
 
-        void emit_s_type(const std::string& insn, const Register& dst, const Register& base, int off) {
-            emit(std::format("{}\t{},\t{}({})", insn, dst, off, base));
+        // Loads read into `dst`, stores write `dst` to memory
+        void emit_s_type(Op op, const Register& dst, const Register& base, int off) {
+            if (is_store(op)) {
+                emit_insn({.op = op, .rs1 = base, .rs2 = dst, .imm = off});
+            } else {
+                emit_insn({.op = op, .rd = dst, .rs1 = base, .imm = off});
+            }
         }
 
-        void symb_emit_r_type(const std::string& insn, const SymbolicLocation& dst, const SymbolicLocation& src1, const SymbolicLocation& src2) {
+        void symb_emit_r_type(Op op, const SymbolicLocation& dst, const SymbolicLocation& src1, const SymbolicLocation& src2) {
             auto src1_reg = to_reg(src1, rv::Register::temp1());
             auto src2_reg = to_reg(src2, rv::Register::temp2());
-
-            switch (dst.type) {
-            case SymbolicStack::LocType::Register:
-                emit_r_type(insn, Register{dst.number}, src1_reg, src2_reg);
-                return;
-            case SymbolicStack::LocType::Memory:
-                emit_r_type(insn, src1_reg, src1_reg, src2_reg);
-                emit_sd(src1_reg, rv::Register::sp(), -dst.number * WORD_SIZE);
-                return;
-            }
+            auto dst_reg = def_reg(dst, rv::Register::temp1());
+            emit_r_type(op, dst_reg, src1_reg, src2_reg);
+            commit(dst, dst_reg);
         }
 
-        void symb_emit_i_type(const std::string& insn, const SymbolicLocation& dst, const SymbolicLocation& src, int imm) {
-            auto dst_reg = to_reg(dst, rv::Register::temp1());
+        void symb_emit_i_type(Op op, const SymbolicLocation& dst, const SymbolicLocation& src, int imm) {
             auto src_reg = to_reg(src, rv::Register::temp2());
-            emit_i_type(insn, dst_reg, src_reg, imm);
+            auto dst_reg = def_reg(dst, rv::Register::temp1());
+            emit_i_type(op, dst_reg, src_reg, imm);
+            commit(dst, dst_reg);
         }
 
-        void symb_emit_u_type(const std::string& insn, const SymbolicLocation& dst, int imm) {
-            auto dst_reg = to_reg(dst, rv::Register::temp1());
-            emit_u_type(insn, dst_reg, imm);
+        void symb_emit_u_type(Op op, const SymbolicLocation& dst, int64_t imm) {
+            auto dst_reg = def_reg(dst, rv::Register::temp1());
+            emit_u_type(op, dst_reg, imm);
+            commit(dst, dst_reg);
         }
 
-        void symb_emit_s_type(const std::string& insn, const SymbolicLocation& dst, const SymbolicLocation& base, int off) {
-            auto dst_reg = to_reg(dst, rv::Register::temp1());
+        // For stores `dst` is the value written to memory
+        void symb_emit_s_type(Op op, const SymbolicLocation& dst, const SymbolicLocation& base, int off) {
             auto base_reg = to_reg(base, rv::Register::temp2());
-            emit_s_type(insn, dst_reg, base_reg, off);
+            if (is_store(op)) {
+                emit_s_type(op, to_reg(dst, rv::Register::temp1()), base_reg, off);
+                return;
+            }
+            auto dst_reg = def_reg(dst, rv::Register::temp1());
+            emit_s_type(op, dst_reg, base_reg, off);
+            commit(dst, dst_reg);
         }
 
-        void symb_emit_pseudo_type(const std::string& insn, const SymbolicLocation& dst, const SymbolicLocation& src) {
-            auto dst_reg = to_reg(dst, rv::Register::temp1());
+        void symb_emit_pseudo_type(Op op, const SymbolicLocation& dst, const SymbolicLocation& src) {
             auto src_reg = to_reg(src, rv::Register::temp2());
-            emit_pseudo_type(insn, dst_reg, src_reg);
+            auto dst_reg = def_reg(dst, rv::Register::temp1());
+            emit_pseudo_type(op, dst_reg, src_reg);
+            commit(dst, dst_reg);
         }
     };
 
-}
\ No newline at end of file
+}
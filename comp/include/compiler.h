@@ -1,18 +1,39 @@
 #pragma once
 
+#include <algorithm>
 #include <format>
+#include <map>
 #include <optional>
 #include <ranges>
+#include <set>
 #include <string>
-#include <unordered_map>
+#include <variant>
 #include <vector>
+#include "callees.h"
 #include "code_buffer.h"
 #include "cpp.h"
+#include "function_ir.h"
+#include "inst_info.h"
+#include "regalloc.h"
+#include "runtime.h"
 #include "symb_stack.h"
 
 namespace lama::rv {
 
-#define DEBUG_COMMENTS 0
+// Extra first argument of a runtime call: an immediate or the address of a symbol
+using ExtraArg = std::variant<int64_t, std::string>;
+
+// Where the values of a function are while one of its calls runs. Offsets are from sp at
+// the call, inside the save area the call pushes.
+struct CallSite {
+    std::string return_label;
+    size_t save_area_size;
+    size_t stack_args;
+    std::vector<std::pair<rv::Register, int>> saved{};
+    // Registers and frame slots holding values live across the call
+    RegisterSet live_registers;
+    std::vector<size_t> live_slots;
+};
 
 class Compiler {
 public:
@@ -23,155 +44,522 @@ public:
     std::vector<std::string_view> strs{};
     size_t globals_count{};
 
-    // Instruction address (in bytecode) to symbolic stack size mapping
-    std::unordered_map<size_t, size_t> done;
-    std::unordered_map<size_t, size_t> todo;
+    // Function being compiled and where the register allocator put its values
+    FunctionIR const* ir{};
+    Allocation const* allocation{};
+    size_t node_index{};
+    // Set when the current instruction already did the work of the next one
+    bool next_fused{};
+    // Whether the code counts how often each block runs, and the bytecode offsets of the
+    // counted blocks in counter order
+    bool instrument{};
+    std::vector<size_t> counted_blocks{};
 
     static std::string label_for_ip(size_t ip) {
         return std::format(".lbc_{:#x}", ip);
     }
 
-    void add_jump_target(size_t offset, size_t stack_height) {
-        auto as_done = done.find(offset);
-        if (as_done == done.end()) {
-            cb.emit_comment(std::format("Expectings stack height {:d} at {:#x}", stack_height, offset));
-            auto [as_todo, is_new] = todo.emplace(offset, stack_height);
-            DCHECK_EQ(as_todo->second, stack_height) << std::format("offset = {:#x}", offset);
-        } else {
-            DCHECK_EQ(as_done->second, stack_height) << std::format("offset = {:#x}", offset);
+    static std::string callee_label(Callee const& callee) {
+        return std::visit(
+            overloads{
+                [](std::string const& name) { return name; },
+                [](size_t offset) { return label_for_ip(offset); },
+                [](ClosureCallee) {
+                    LOG(FATAL) << "closures are called through their code pointer";
+                    return std::string{};
+                },
+            },
+            callee
+        );
+    }
+
+    // Emits the label of the `index`-th node of the current function and sets up the
+    // symbolic stack with the locations of its operands
+    void begin_instruction(size_t index) {
+        node_index = index;
+        auto const& node = ir->nodes[index];
+        cb.emit_label(label_for_ip(node.offset));
+        auto const locs_of = [this](std::vector<size_t> const& vregs) {
+            std::vector<SymbolicStack::Loc> locs;
+            locs.reserve(vregs.size());
+            for (auto v : vregs) {
+                locs.push_back(allocation->locs[v]);
+            }
+            return locs;
+        };
+        st.reset(locs_of(node.entry_stack), locs_of(node.defs));
+    }
+
+    // Whether the next instruction is reached only from the current one and is the only
+    // reader of its results, so that the two can be compiled together
+    bool results_feed_next_only() const {
+        auto const& node = ir->nodes[node_index];
+        if (node.succs.size() != 1 || node.succs.front() != node_index + 1) {
+            return false;
         }
+        auto const& next = ir->nodes[node_index + 1];
+        return next.preds.size() == 1 && std::ranges::none_of(node.defs, [&next](size_t v) {
+                   return next.live_out[v];
+               });
     }
 
-    void inst_begin(size_t offset) {
-        size_t const stack_height = st.top;
-        auto [as_done, inserted] = done.emplace(offset, stack_height);
-        DCHECK_EQ(as_done->second, stack_height) << std::format("offset = {:#x}", offset);
-        auto const label = label_for_ip(offset);
-        if (inserted) {
-            cb.emit_label(label);
-        } else {
-            cb.emit_comment(label);
+    SymbolicStack::Loc variable(LocationEntry entry) const {
+        auto const v = ir->variable(entry);
+        DCHECK(v.has_value()) << "variable is not referenced by the function";
+        return allocation->locs[*v];
+    }
+
+    // Where the function keeps the closure it was called through
+    SymbolicStack::Loc closure() const {
+        DCHECK(ir->closure.has_value()) << "function does not refer to its closure";
+        return allocation->locs[*ir->closure];
+    }
+
+    // Whether vreg `v` holds an unboxed integer
+    bool unboxed(size_t v) const {
+        return allocation->unboxed[v];
+    }
+
+    // Registers and frame slots holding the values that live across a call made by the
+    // current instruction; with `boxed_only`, only those the collector may look at
+    std::pair<RegisterSet, std::vector<size_t>> live_across_call(bool boxed_only = false) const {
+        auto const& node = ir->nodes[node_index];
+        RegisterSet registers;
+        std::set<size_t> slots;
+        node.live_out.for_each([&](size_t v) {
+            if (boxed_only && unboxed(v)) {
+                return;
+            }
+            auto const& loc = allocation->locs[v];
+            if (loc.type == SymbolicStack::LocType::Register) {
+                registers.set(loc.number);
+            } else if (loc.type == SymbolicStack::LocType::Memory) {
+                slots.insert(loc.number);
+            }
+        });
+        // The results are written after the call
+        ir->for_each_def(node, [&](size_t v) {
+            auto const& loc = allocation->locs[v];
+            if (loc.type == SymbolicStack::LocType::Register) {
+                registers.reset(loc.number);
+            } else if (loc.type == SymbolicStack::LocType::Memory) {
+                slots.erase(loc.number);
+            }
+        });
+        // A closure is filled in with the variables it captures after its slow path
+        for (auto v : node.closure_reads) {
+            auto const& loc = allocation->locs[v];
+            if (loc.type == SymbolicStack::LocType::Register) {
+                registers.set(loc.number);
+            } else if (loc.type == SymbolicStack::LocType::Memory) {
+                slots.insert(loc.number);
+            }
+        }
+        // Fields of objects built in the frame are zeroed by the prologue and kept up to date
+        for (auto const& [_, object] : allocation->frame_objects) {
+            slots.insert(object.value_slots.begin(), object.value_slots.end());
         }
+        return {registers, {slots.begin(), slots.end()}};
+    }
+
+    // Where the object the current instruction builds goes in the frame, if it does
+    FrameObject const* frame_object() const {
+        auto const it = allocation->frame_objects.find(node_index);
+        return it == allocation->frame_objects.end() ? nullptr : &it->second;
+    }
+
+    // Registers the current instruction must save around a call to `callee`: those holding
+    // values that live across it and that the callee may clobber, and, if the collector
+    // may run, the live callee-saved registers, so that it finds and updates them. The
+    // values of the callers are saved by the prologue instead. The globals pointer is not
+    // saved but set again after the call.
+    std::vector<rv::Register> registers_to_save(Callee const& callee) const {
+        auto const effects = callee_effects(callee);
+        auto const live = live_across_call().first;
+        std::vector<rv::Register> saved;
+        rv::Register::temp_apply([&](rv::Register const& r, int) {
+            if (live[r.regno] && effects.clobbers[r.regno]) {
+                saved.push_back(r);
+            }
+        });
+        rv::Register::saved_apply([&](rv::Register const& r, int) {
+            if (live[r.regno] && (effects.clobbers[r.regno] || effects.may_collect)) {
+                saved.push_back(r);
+            }
+        });
+        return saved;
     }
 
-    bool should_emit(size_t offset) const {
-        auto emitted = done.find(offset);
-        if (emitted == done.end()) {
-            return true;
+    void compile_call(Callee callee, size_t argc, std::optional<ExtraArg> extra_arg = std::nullopt) {
+        std::vector<SymbolicStack::Loc> args(argc);
+        for (auto& arg : args | std::views::reverse) {
+            arg = st.pop();
         }
-        DCHECK_EQ(emitted->second, st.top) << std::format("offset = {:#x}", offset);
-        return false;
+        emit_call(callee, args, std::move(extra_arg));
+        cb.symb_emit_mv(st.alloc(), rv::Register::arg(0));
     }
 
-    void debug_stack_height() {
-#if DEBUG_COMMENTS
-        cb.emit_comment(std::format("stack height = {:d}", st.top));
-#endif
+    // Calls `callee` with the arguments at `args`, preceded by `extra_arg` if given, leaving
+    // the symbolic stack alone. The result is in a0.
+    void emit_call(
+        Callee const& callee, std::vector<SymbolicStack::Loc> const& args, std::optional<ExtraArg> extra_arg = std::nullopt
+    ) {
+        emit_call_sequence(callee, args, std::move(extra_arg), [&] { cb.emit_call(callee_label(callee)); });
     }
 
-    void
-    compile_call(std::variant<std::string, size_t> callee, size_t argc, std::optional<int64_t> opt_arg = std::nullopt) {
-        size_t add_arg = opt_arg.has_value();
-        argc += add_arg;
-        size_t alignment = (current_frame->locals_count + st.spilled_count() + (argc > 8 ? argc - 8 : 0)) & 1;
-        // Skip spilled registers
-        cb.emit_addi(rv::Register::sp(), rv::Register::sp(), -st.spilled_count() * rv::WORD_SIZE);
-        // Save ra
-        cb.emit_sd(rv::Register::ra(), rv::Register::sp(), -rv::WORD_SIZE);
-        cb.emit_addi(rv::Register::sp(), rv::Register::sp(), -rv::WORD_SIZE);
-        // Save temp registers
-        rv::Register::temp_apply([this](rv::Register const& r, int) {
-            cb.emit_sd(r, rv::Register::sp(), -rv::WORD_SIZE);
-            cb.emit_addi(rv::Register::sp(), rv::Register::sp(), -rv::WORD_SIZE);
+    // Calls the function of the closure at `closure` with the arguments at `args`, leaving
+    // the symbolic stack alone. The callee finds the closure in its own register. The call
+    // is direct if the closure is known to be one of the function at offset `entry`. The
+    // result is in a0.
+    void emit_closure_call(
+        SymbolicStack::Loc const& closure, std::vector<SymbolicStack::Loc> const& args, std::optional<size_t> entry
+    ) {
+        Callee const callee = entry ? Callee{*entry} : Callee{ClosureCallee{}};
+        emit_call_sequence(callee, args, std::nullopt, [&] {
+            cb.symb_emit_mv(rv::Register::closure(), closure);
+            if (entry) {
+                cb.emit_call(label_for_ip(*entry));
+            } else {
+                cb.emit_ld(rv::Register::temp1(), rv::Register::closure(), 0);
+                cb.emit_call_indirect(rv::Register::temp1());
+            }
         });
-        // Save arguments
-        rv::Register::arg_apply([this](rv::Register const& r, int) {
-            cb.emit_sd(r, rv::Register::sp(), -rv::WORD_SIZE);
-            cb.emit_addi(rv::Register::sp(), rv::Register::sp(), -rv::WORD_SIZE);
+    }
+
+    // Calls `callee` with its arguments already in a0-a7, leaving the symbolic stack alone.
+    // Used by the slow paths of inlined runtime functions.
+    void call_in_place(Callee const& callee) {
+        auto const saved = registers_to_save(callee);
+        auto const area = open_save_area(saved, 0);
+        cb.emit_call(callee_label(callee));
+        record_call_site(callee, saved, area);
+        close_save_area(saved, area);
+        restore_globals_pointer(callee);
+    }
+
+    // Fresh assembler-local label
+    std::string new_label() {
+        return std::format(".L{}", labels_count_++);
+    }
+
+    Compiler(
+        std::string_view file,
+        std::ostream& out,
+        size_t globals,
+        std::vector<std::string_view>&& strings,
+        OutputFormat format = OutputFormat::Asm,
+        TargetFeatures target = {}
+    )
+        : filename(file)
+        , cb(out, format, target)
+        , strs(strings)
+        , globals_count(globals) {}
+
+    void header() {
+        cb.emit_section(".rodata");
+        // String literals laid out as heap objects, padded to whole words, which STRING copies
+        // or pushes as they are. The collector leaves them alone, as they are outside the heap.
+        for (size_t i = 0; i < strs.size(); ++i) {
+            cb.emit_align(3);
+            cb.emit_fill(1, WORD_SIZE, static_cast<int64_t>(strs[i].size() << 3) | STRING_TAG);
+            cb.emit_fill(1, WORD_SIZE, 0);
+            cb.emit_label(std::format("string_{}", i));
+            cb.emit_string(strs[i]);
+        }
+        cb.emit_align(3);
+        cb.emit_section("custom_data");
+        cb.emit_fill(128, 8, 1);
+        cb.emit_section(".data");
+        cb.emit_label("globals");
+        cb.emit_fill(globals_count, 8, 0);
+        cb.emit_align(3);
+        cb.emit_label("fname");
+        cb.emit_string(filename);
+        cb.emit_section(".text");
+        cb.emit_global("main");
+    }
+
+    void premain() {
+        cb.emit_sd_symbol(rv::Register::fp(), "__gc_stack_bottom", rv::Register::gp());
+        cb.emit_call("__init");
+        if (instrument) {
+            cb.emit_la(rv::Register::arg(0), "__profile_table");
+            cb.emit_la(rv::Register::arg(1), "__profile_counts");
+            cb.emit_call("__profile_start");
+        }
+        cb.emit_la(rv::Register::gp(), "globals");
+    }
+
+    // Increments the counter of the block starting at `offset`; only temporaries change
+    void count_block(size_t offset) {
+        auto const temp1 = rv::Register::temp1(), temp2 = rv::Register::temp2();
+        auto counter_offset = static_cast<int64_t>(counted_blocks.size() * WORD_SIZE);
+        counted_blocks.push_back(offset);
+        cb.emit_la(temp1, "__profile_counts");
+        if (counter_offset >= 2048) {
+            cb.emit_li(temp2, counter_offset);
+            cb.emit_add(temp1, temp1, temp2);
+            counter_offset = 0;
+        }
+        cb.emit_ld(temp2, temp1, static_cast<int>(counter_offset));
+        cb.emit_addi(temp2, temp2, 1);
+        cb.emit_sd(temp2, temp1, static_cast<int>(counter_offset));
+    }
+
+    // Data the runtime dumps the profile from: the number of counted blocks, their offsets,
+    // then the counters
+    void profile_tables() {
+        cb.emit_section(".data");
+        cb.emit_align(3);
+        cb.emit_label("__profile_table");
+        cb.emit_fill(1, WORD_SIZE, static_cast<int64_t>(counted_blocks.size()));
+        for (auto offset : counted_blocks) {
+            cb.emit_fill(1, WORD_SIZE, static_cast<int64_t>(offset));
+        }
+        cb.emit_label("__profile_counts");
+        cb.emit_fill(counted_blocks.size(), WORD_SIZE, 0);
+    }
+
+    // Stack maps the collector finds the values on the stack by, in read-only data:
+    // `__gc_frame_descriptors`, then `__gc_stack_maps` with the number of call sites and, for
+    // each in code order, its return address and the word offset of its frame descriptor.
+    //
+    // A descriptor holds the distance from sp at the call to sp at the call of the caller,
+    // the offset of the return address into the caller, the registers holding live values,
+    // the registers saved around the call and those saved by the prologue, each as
+    // `offset << 8 | regno` after their count, then the count and offsets of the slots
+    // holding live values.
+    void stack_maps() {
+        cb.emit_section(".rodata");
+        cb.emit_align(3);
+        cb.emit_global("__gc_frame_descriptors");
+        cb.emit_label("__gc_frame_descriptors");
+        for (auto word : descriptor_words_) {
+            cb.emit_fill(1, WORD_SIZE, word);
+        }
+        cb.emit_global("__gc_stack_maps");
+        cb.emit_label("__gc_stack_maps");
+        cb.emit_fill(1, WORD_SIZE, static_cast<int64_t>(stack_maps_.size()));
+        for (auto const& [label, descriptor] : stack_maps_) {
+            cb.emit_address(label);
+            cb.emit_fill(1, WORD_SIZE, static_cast<int64_t>(descriptor));
+        }
+    }
+
+    void postmain() {
+        cb.emit_srai(rv::Register::arg(0), rv::Register::arg(0), 1);
+    }
+
+    // Inserts the prologue and the epilogues of the function just compiled. They save ra if
+    // the function calls, fp if it addresses its frame, and the callee-saved registers it
+    // writes, or all of them if it calls into the collector, which then finds the values of
+    // the callers there; a leaf function without spills gets no frame at all. The stack maps
+    // of its calls tell the collector where the saved registers are.
+    void finish_function() {
+        DCHECK(current_frame.has_value()) << "no function to finish";
+        auto const& frame = *current_frame;
+        bool calls = false;
+        RegisterSet read, written;
+        for (auto const& item : cb.items() | std::views::drop(frame.prologue)) {
+            if (auto const* insn = std::get_if<Insn>(&item)) {
+                calls = calls || insn->op == Op::Call || (insn->op == Op::Jalr && insn->rd == rv::Register::ra());
+                read.set(insn->rs1.regno).set(insn->rs2.regno);
+                written.set(insn->rd.regno);
+            }
+        }
+        std::vector<rv::Register> saved;
+        if (calls) {
+            saved.push_back(rv::Register::ra());
+        }
+        rv::Register::saved_apply([&](rv::Register const& r, int) {
+            bool const is_fp = r.regno == rv::Register::fp().regno;
+            if (written[r.regno] || (is_fp && read[r.regno]) || (!is_fp && calls_collector_)) {
+                saved.push_back(r);
+            }
         });
-        if (add_arg)
-            cb.emit_li(rv::Register::arg(0), *opt_arg);
-        for (auto i : std::views::iota(add_arg, argc) | std::views::take(8 - add_arg) | std::views::reverse) {
-            cb.symb_emit_mv(rv::Register::arg(i), st.pop());
+        calls_collector_ = false;
+        DCHECK(frame.slots_count == 0 || read[rv::Register::fp().regno]) << "spill slots are never accessed";
+        if (saved.empty()) {
+            DCHECK(call_sites_.empty()) << "calls without a saved return address";
+            current_frame.reset();
+            return;
+        }
+        // One more word at the bottom: the collector does not scan the word at sp
+        int const frame_size = static_cast<int>((frame.slots_count + saved.size() + 2) / 2 * 2 * WORD_SIZE);
+        CHECK_LT(frame_size, 2048) << "frame of " << frame.function_name << " is too large";
+        auto const save_offset = [](size_t i) { return static_cast<int>((i + 1) * WORD_SIZE); };
+        add_frame_descriptors(saved, frame_size);
+        // Later positions first, so that the earlier ones stay valid
+        for (auto position : frame.epilogues | std::views::reverse) {
+            auto const start = cb.position();
+            for (size_t i = 0; i < saved.size(); ++i) {
+                cb.emit_ld(saved[i], rv::Register::sp(), save_offset(i));
+            }
+            cb.emit_addi(rv::Register::sp(), rv::Register::sp(), frame_size);
+            cb.move_emitted(start, position);
+        }
+        auto const start = cb.position();
+        cb.emit_addi(rv::Register::sp(), rv::Register::sp(), -frame_size);
+        for (size_t i = 0; i < saved.size(); ++i) {
+            cb.emit_sd(saved[i], rv::Register::sp(), save_offset(i));
+        }
+        if (read[rv::Register::fp().regno]) {
+            cb.emit_addi(rv::Register::fp(), rv::Register::sp(), frame_size);
+        }
+        cb.move_emitted(start, frame.prologue);
+        current_frame.reset();
+    }
+
+private:
+    // Sets the globals pointer again after a call to `callee` that may have changed it
+    void restore_globals_pointer(Callee const& callee) {
+        if (callee_effects(callee).clobbers[rv::Register::gp().regno]) {
+            cb.emit_la(rv::Register::gp(), "globals");
+        }
+    }
+
+    struct SaveArea {
+        size_t stack_args;
+        size_t base;
+        size_t slots;
+    };
+
+    // Save area, from sp up: stack arguments (or a padding word, as the collector starts
+    // scanning above the word at sp), then the saved registers.
+    SaveArea open_save_area(std::vector<rv::Register> const& saved, size_t stack_args) {
+        SaveArea area{.stack_args = stack_args, .base = std::max<size_t>(stack_args, 1), .slots = 0};
+        if (stack_args != 0 || !saved.empty()) {
+            area.slots = area.base + saved.size();
         }
         // Align sp to 16 bytes
-        if (alignment) {
-            cb.emit_addi(rv::Register::sp(), rv::Register::sp(), -rv::WORD_SIZE);
+        area.slots += area.slots & 1;
+        if (area.slots != 0) {
+            cb.emit_addi(rv::Register::sp(), rv::Register::sp(), -static_cast<int>(area.slots) * rv::WORD_SIZE);
+        }
+        for (size_t i = 0; i < saved.size(); ++i) {
+            cb.emit_sd(saved[i], rv::Register::sp(), (area.base + i) * rv::WORD_SIZE);
         }
+        return area;
+    }
+
+    void close_save_area(std::vector<rv::Register> const& saved, SaveArea const& area) {
+        for (size_t i = 0; i < saved.size(); ++i) {
+            cb.emit_ld(saved[i], rv::Register::sp(), (area.base + i) * rv::WORD_SIZE);
+        }
+        if (area.slots != 0) {
+            cb.emit_addi(rv::Register::sp(), rv::Register::sp(), area.slots * rv::WORD_SIZE);
+        }
+    }
+
+    // Saves what the call to `callee` must keep and passes the arguments around the call
+    // `emit_call_insn` emits
+    void emit_call_sequence(
+        Callee const& callee,
+        std::vector<SymbolicStack::Loc> const& args,
+        std::optional<ExtraArg> extra_arg,
+        auto const& emit_call_insn
+    ) {
+        size_t const add_arg = extra_arg.has_value();
+        size_t const argc = args.size() + add_arg;
+        auto const saved = registers_to_save(callee);
+        size_t const stack_args = argc > 8 ? argc - 8 : 0;
+        auto const area = open_save_area(saved, stack_args);
         // Store extra arguments on stack
-        for (auto _ : std::views::iota(0ul, argc) | std::views::drop(8) | std::views::reverse) {
-            cb.emit_sd(cb.to_reg(st.pop(), rv::Register::temp1()), rv::Register::sp(), -rv::WORD_SIZE);
-            cb.emit_addi(rv::Register::sp(), rv::Register::sp(), -rv::WORD_SIZE);
+        for (auto k : std::views::iota(8ul, std::max(argc, 8ul)) | std::views::reverse) {
+            cb.emit_sd(cb.to_reg(args[k - add_arg], rv::Register::temp1()), rv::Register::sp(), (k - 8) * rv::WORD_SIZE);
         }
-        // Call function
-        cb.emit_call(std::visit(
-            overloads{
-                [](std::string name) { return name; },
-                [this](size_t offset) {
-                    add_jump_target(offset, 0);
-                    return label_for_ip(offset);
+        for (auto i : std::views::iota(add_arg, std::min(argc, 8ul)) | std::views::reverse) {
+            cb.symb_emit_mv(rv::Register::arg(i), args[i - add_arg]);
+        }
+        if (extra_arg) {
+            std::visit(
+                overloads{
+                    [this](int64_t value) { cb.emit_li(rv::Register::arg(0), value); },
+                    [this](std::string const& symbol) { cb.emit_la(rv::Register::arg(0), symbol); },
                 },
-            },
-            callee
-        ));
-        // Drop extra arguments from stack
-        if (argc > 8) {
-            cb.emit_addi(rv::Register::sp(), rv::Register::sp(), (argc - 8) * rv::WORD_SIZE);
+                *extra_arg
+            );
         }
-        if (alignment) {
-            cb.emit_addi(rv::Register::sp(), rv::Register::sp(), rv::WORD_SIZE);
+        emit_call_insn();
+        record_call_site(callee, saved, area);
+        close_save_area(saved, area);
+        restore_globals_pointer(callee);
+    }
+
+    // Labels the return address of a call the collector may run under, directly or in a
+    // Lama function, and records where the values of the current function are meanwhile
+    void record_call_site(Callee const& callee, std::vector<rv::Register> const& saved, SaveArea const& area) {
+        if (std::holds_alternative<std::string>(callee)) {
+            if (!callee_effects(callee).may_collect) {
+                return;
+            }
+            calls_collector_ = true;
         }
-        cb.symb_emit_mv(st.alloc(), rv::Register::arg(0));
-        // Restore arguments
-        for (auto i : std::views::iota(0ul, 8ul) | std::views::reverse) {
-            cb.emit_ld(rv::Register::arg(i), rv::Register::sp(), 0);
-            cb.emit_addi(rv::Register::sp(), rv::Register::sp(), rv::WORD_SIZE);
+        auto [live_registers, live_slots] = live_across_call(true);
+        CallSite site{
+            .return_label = new_label(),
+            .save_area_size = area.slots * WORD_SIZE,
+            .stack_args = area.stack_args,
+            .live_registers = live_registers,
+            .live_slots = std::move(live_slots),
         };
-        // Restore temp registers
-        cb.emit_addi(rv::Register::sp(), rv::Register::sp(), 8 * rv::WORD_SIZE);
-        rv::Register::temp_apply([this](rv::Register const& r, int i) {
-            cb.emit_ld(r, rv::Register::sp(), -(i + 1) * rv::WORD_SIZE);
-        });
-        // Restore ra
-        cb.emit_ld(rv::Register::ra(), rv::Register::sp(), -rv::WORD_SIZE);
-        cb.emit_addi(rv::Register::sp(), rv::Register::sp(), st.spilled_count() * rv::WORD_SIZE);
+        for (size_t i = 0; i < saved.size(); ++i) {
+            site.saved.emplace_back(saved[i], static_cast<int>((area.base + i) * WORD_SIZE));
+        }
+        cb.emit_label(site.return_label);
+        call_sites_.push_back(std::move(site));
     }
 
-    Compiler(std::string_view file, std::ostream& out, size_t globals, std::vector<std::string_view>&& strings)
-        : filename(file)
-        , cb(out)
-        , strs(strings)
-        , globals_count(globals) {}
-
-    void header() {
-        std::string string_tab;
-        for (int i = 0; i < strs.size(); ++i) {
-            string_tab.append(std::format("string_{}: .asciz \"{}\"\n", i, strs[i]));
-        }
-        cb.emit(std::format(
-            R"(.section .rodata
-.section custom_data,"aw",@progbits
-.fill 128, 8, 1
-.data
-globals:
-.fill {:d}, 8, 0
-.align 8
-fname: .asciz "{}"
-{}
-.text
-.global main)",
-            globals_count, filename, string_tab
-        ));
-    }
-
-    std::string premain() {
-        return R"(
-sd fp, __gc_stack_bottom, t0
-la t0, globals)";
-    }
-
-    std::string postmain() {
-        return R"(srai a0, a0, 1)";
+    // Turns the call sites of the function just compiled into frame descriptors, once its
+    // prologue saves `saved`, the return address first, in a frame of `frame_size` bytes
+    void add_frame_descriptors(std::vector<rv::Register> const& saved, int frame_size) {
+        auto const pack = [](rv::Register const& r, int64_t offset) {
+            return offset << 8 | static_cast<int64_t>(r.regno);
+        };
+        for (auto const& site : call_sites_) {
+            auto const area = static_cast<int64_t>(site.save_area_size);
+            std::vector<int64_t> descriptor{
+                area + frame_size,
+                area + WORD_SIZE,
+                static_cast<int64_t>(site.live_registers.to_ullong()),
+                static_cast<int64_t>(site.saved.size()),
+            };
+            for (auto const& [r, offset] : site.saved) {
+                descriptor.push_back(pack(r, offset));
+            }
+            // Callee-saved registers the prologue saves hold the values of the caller
+            std::vector<int64_t> callers;
+            for (size_t i = 1; i < saved.size(); ++i) {
+                if (saved[i].regno != rv::Register::fp().regno) {
+                    callers.push_back(pack(saved[i], area + static_cast<int64_t>((i + 1) * WORD_SIZE)));
+                }
+            }
+            descriptor.push_back(static_cast<int64_t>(callers.size()));
+            descriptor.insert(descriptor.end(), callers.begin(), callers.end());
+            // Stack arguments are values the callee may still read
+            descriptor.push_back(static_cast<int64_t>(site.stack_args + site.live_slots.size()));
+            for (size_t k = 0; k < site.stack_args; ++k) {
+                descriptor.push_back(static_cast<int64_t>(k * WORD_SIZE));
+            }
+            for (auto slot : site.live_slots) {
+                descriptor.push_back(area + frame_size + FrameInfo::offset(slot));
+            }
+            auto [it, inserted] = descriptor_offsets_.emplace(std::move(descriptor), descriptor_words_.size());
+            if (inserted) {
+                descriptor_words_.insert(descriptor_words_.end(), it->first.begin(), it->first.end());
+            }
+            stack_maps_.emplace_back(site.return_label, it->second);
+        }
+        call_sites_.clear();
     }
+
+    size_t labels_count_{};
+    // Whether the function being compiled calls a runtime function that may collect
+    bool calls_collector_{};
+    std::vector<CallSite> call_sites_{};
+    // Frame descriptors back to back, where each starts, and the call sites using them
+    std::vector<int64_t> descriptor_words_{};
+    std::map<std::vector<int64_t>, size_t> descriptor_offsets_{};
+    std::vector<std::pair<std::string, size_t>> stack_maps_{};
 };
 }  // namespace lama::rv
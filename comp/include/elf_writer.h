@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "insn.h"
+
+namespace lama::rv {
+
+// Encodes the buffered program into machine code and writes it as a relocatable ELF64 object.
+// Branches and jumps to local labels are resolved in place, references to other symbols
+// (calls, `la`, stores to globals) become relocations for the linker. With the C extension
+// every instruction that has a 16-bit form gets it.
+void write_object(std::vector<Item> const& items, std::ostream& out, TargetFeatures const& target = {});
+
+// Bytes of machine code of a function, without and with the C extension
+struct FunctionSize {
+    std::string name;
+    uint64_t full;
+    uint64_t compressed;
+};
+
+struct CodeSizes {
+    std::vector<FunctionSize> functions{};
+};
+
+std::ostream& operator<<(std::ostream& os, CodeSizes const& sizes);
+
+// Encodes the buffered program both ways and measures the code from each of the labels
+// `functions` to the next of them or the end of .text
+CodeSizes measure_code_size(std::vector<Item> const& items, std::vector<std::string> const& functions);
+
+}  // namespace lama::rv
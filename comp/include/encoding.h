@@ -0,0 +1,156 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <vector>
+#include "insn.h"
+#include "register.h"
+
+namespace lama::rv {
+
+constexpr bool fits_signed(int64_t value, unsigned bits) {
+    int64_t const bound = int64_t{1} << (bits - 1);
+    return -bound <= value && value < bound;
+}
+
+constexpr int64_t sign_extend(uint64_t value, unsigned bits) {
+    uint64_t const sign = uint64_t{1} << (bits - 1);
+    value &= (sign << 1) - 1;
+    return static_cast<int64_t>(value ^ sign) - static_cast<int64_t>(sign);
+}
+
+// Base instruction formats of the RV64I specification
+
+constexpr uint32_t encode_r(uint32_t opcode, uint32_t funct3, uint32_t funct7, Register rd, Register rs1, Register rs2) {
+    return funct7 << 25 | rs2.regno << 20 | rs1.regno << 15 | funct3 << 12 | rd.regno << 7 | opcode;
+}
+
+constexpr uint32_t encode_i(uint32_t opcode, uint32_t funct3, Register rd, Register rs1, int64_t imm) {
+    return (static_cast<uint32_t>(imm) & 0xfff) << 20 | rs1.regno << 15 | funct3 << 12 | rd.regno << 7 | opcode;
+}
+
+constexpr uint32_t encode_s(uint32_t opcode, uint32_t funct3, Register rs1, Register rs2, int64_t imm) {
+    auto const bits = static_cast<uint32_t>(imm);
+    return (bits >> 5 & 0x7f) << 25 | rs2.regno << 20 | rs1.regno << 15 | funct3 << 12 | (bits & 0x1f) << 7 | opcode;
+}
+
+constexpr uint32_t encode_b(uint32_t opcode, uint32_t funct3, Register rs1, Register rs2, int64_t offset) {
+    auto const bits = static_cast<uint32_t>(offset);
+    return (bits >> 12 & 1) << 31 | (bits >> 5 & 0x3f) << 25 | rs2.regno << 20 | rs1.regno << 15 | funct3 << 12 |
+           (bits >> 1 & 0xf) << 8 | (bits >> 11 & 1) << 7 | opcode;
+}
+
+constexpr uint32_t encode_u(uint32_t opcode, Register rd, int64_t imm20) {
+    return (static_cast<uint32_t>(imm20) & 0xfffff) << 12 | rd.regno << 7 | opcode;
+}
+
+constexpr uint32_t encode_j(uint32_t opcode, Register rd, int64_t offset) {
+    auto const bits = static_cast<uint32_t>(offset);
+    return (bits >> 20 & 1) << 31 | (bits >> 1 & 0x3ff) << 21 | (bits >> 11 & 1) << 20 | (bits >> 12 & 0xff) << 12 |
+           rd.regno << 7 | opcode;
+}
+
+// Compressed formats of the C extension. Immediates come already scattered into the bits
+// of their fields, primed registers (x8-x15) as their 3-bit numbers
+
+constexpr uint16_t encode_cr(uint32_t opcode, uint32_t funct4, Register rd, Register rs2) {
+    return static_cast<uint16_t>(funct4 << 12 | rd.regno << 7 | rs2.regno << 2 | opcode);
+}
+
+constexpr uint16_t encode_ci(uint32_t opcode, uint32_t funct3, Register rd, uint32_t imm12, uint32_t imm6_2) {
+    return static_cast<uint16_t>(funct3 << 13 | imm12 << 12 | rd.regno << 7 | imm6_2 << 2 | opcode);
+}
+
+constexpr uint16_t encode_css(uint32_t opcode, uint32_t funct3, Register rs2, uint32_t imm12_7) {
+    return static_cast<uint16_t>(funct3 << 13 | imm12_7 << 7 | rs2.regno << 2 | opcode);
+}
+
+constexpr uint16_t encode_ciw(uint32_t opcode, uint32_t funct3, uint32_t rd, uint32_t imm12_5) {
+    return static_cast<uint16_t>(funct3 << 13 | imm12_5 << 5 | rd << 2 | opcode);
+}
+
+// Also CS, with the stored register in place of `rd`
+constexpr uint16_t encode_cl(
+    uint32_t opcode, uint32_t funct3, uint32_t rd, uint32_t rs1, uint32_t imm12_10, uint32_t imm6_5
+) {
+    return static_cast<uint16_t>(funct3 << 13 | imm12_10 << 10 | rs1 << 7 | imm6_5 << 5 | rd << 2 | opcode);
+}
+
+constexpr uint16_t encode_ca(uint32_t opcode, uint32_t funct6, uint32_t funct2, uint32_t rd, uint32_t rs2) {
+    return static_cast<uint16_t>(funct6 << 10 | rd << 7 | funct2 << 5 | rs2 << 2 | opcode);
+}
+
+constexpr uint16_t encode_cb(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t imm12_10, uint32_t imm6_2) {
+    return static_cast<uint16_t>(funct3 << 13 | imm12_10 << 10 | rs1 << 7 | imm6_2 << 2 | opcode);
+}
+
+constexpr uint16_t encode_cj(uint32_t opcode, uint32_t funct3, uint32_t imm12_2) {
+    return static_cast<uint16_t>(funct3 << 13 | imm12_2 << 2 | opcode);
+}
+
+// Splits a pc-relative offset into the %hi/%lo pair used by auipc-based sequences
+constexpr int64_t hi20(int64_t value) {
+    return (value + 0x800) >> 12;
+}
+
+constexpr int64_t lo12(int64_t value) {
+    return sign_extend(static_cast<uint64_t>(value), 12);
+}
+
+// Materializes a 64-bit constant with lui/addiw, then slli/addi for the bits above 32
+inline void li_shifted_sequence(Register rd, int64_t value, std::vector<Insn>& out) {
+    if (fits_signed(value, 32)) {
+        int64_t const hi = sign_extend(static_cast<uint64_t>(hi20(value)), 20);
+        if (hi != 0) {
+            out.push_back({.op = Op::Lui, .rd = rd, .imm = hi});
+        }
+        if (hi == 0) {
+            out.push_back({.op = Op::Addi, .rd = rd, .rs1 = Register::zero(), .imm = lo12(value)});
+        } else if (lo12(value) != 0) {
+            out.push_back({.op = Op::Addiw, .rd = rd, .rs1 = rd, .imm = lo12(value)});
+        }
+        return;
+    }
+    int64_t const lo = lo12(value);
+    auto const hi = (static_cast<uint64_t>(value) + 0x800) >> 12;
+    int shift = 12 + std::countr_zero(hi);
+    int64_t upper = sign_extend(hi >> (shift - 12), 64 - shift);
+    // Shifting by 12 less leaves low zeros that lui makes for free
+    auto const upper_lui = static_cast<int64_t>(static_cast<uint64_t>(upper) << 12);
+    if (shift > 12 && !fits_signed(upper, 12) && fits_signed(upper_lui, 32)) {
+        shift -= 12;
+        upper = upper_lui;
+    }
+    li_shifted_sequence(rd, upper, out);
+    out.push_back({.op = Op::Slli, .rd = rd, .rs1 = rd, .imm = shift});
+    if (lo != 0) {
+        out.push_back({.op = Op::Addi, .rd = rd, .rs1 = rd, .imm = lo});
+    }
+}
+
+// Materializes an arbitrary 64-bit constant. The sequence is the one LLVM picks, so that
+// objects match those the assembler makes
+inline void li_sequence(Register rd, int64_t value, std::vector<Insn>& out) {
+    std::vector<Insn> best;
+    li_shifted_sequence(rd, value, best);
+    if (value > 0 && best.size() > 2) {
+        // The leading zeros of a positive constant may be cheaper to clear with a final srli,
+        // shifting out ones or zeros
+        int const zeros = std::countl_zero(static_cast<uint64_t>(value));
+        auto const shifted = static_cast<uint64_t>(value) << zeros;
+        for (uint64_t const fill : {(uint64_t{1} << zeros) - 1, uint64_t{0}}) {
+            std::vector<Insn> seq;
+            li_shifted_sequence(rd, static_cast<int64_t>(shifted | fill), seq);
+            seq.push_back({.op = Op::Srli, .rd = rd, .rs1 = rd, .imm = zeros});
+            if (seq.size() < best.size()) {
+                best = std::move(seq);
+            }
+            if (best.size() <= 2) {
+                break;
+            }
+        }
+    }
+    out.insert(out.end(), best.begin(), best.end());
+}
+
+}  // namespace lama::rv
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "function_ir.h"
+#include "regalloc.h"
+
+namespace lama::rv {
+
+// Escape analysis of the objects SEXP, ARRAY and STRING build.
+//
+// An object does not escape when the function building it only examines it: reads its
+// elements, tests its shape, compares it, keeps it in locals, or hands it to Lama functions
+// that do no more with the corresponding parameter. Such an object cannot outlive the call of
+// the function and can be built in its frame. Nothing writes to such a string either, so the
+// static copy of its literal can stand in for it, unless the string is compared.
+class EscapeAnalysis {
+public:
+    // Largest object built in a frame and the most words of such objects in one frame,
+    // headers included
+    static constexpr size_t max_object_words = 10;
+    static constexpr size_t max_frame_words = 64;
+
+    // `functions` are all functions of the program, by the offset of their BEGIN
+    explicit EscapeAnalysis(std::vector<std::pair<size_t, FunctionIR const*>> const& functions);
+
+    // Nodes of `ir` whose objects can be built in its frame, with their sizes in words
+    std::vector<std::pair<size_t, size_t>> frame_objects(FunctionIR const& ir) const;
+
+    // Nodes of `ir` whose strings can be their static literals
+    std::vector<size_t> shared_strings(FunctionIR const& ir) const;
+
+private:
+    // Parameters that may escape from each function
+    std::unordered_map<size_t, std::vector<bool>> escaping_params_{};
+
+    // Vregs that may hold the value of `vreg`, none if it may escape
+    std::optional<VregSet> aliases(FunctionIR const& ir, size_t vreg) const;
+};
+
+// Reserves frame slots below the spill slots for the objects `frame_objects` found
+void place_frame_objects(
+    Allocation& allocation, FunctionIR const& ir, std::vector<std::pair<size_t, size_t>> const& objects
+);
+
+}  // namespace lama::rv
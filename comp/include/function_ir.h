@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+#include "inst_info.h"
+#include "opcode.h"
+
+namespace lama {
+class Instruction;
+}
+
+namespace lama::rv {
+
+// Set of virtual registers
+class VregSet {
+public:
+    explicit VregSet(size_t size = 0)
+        : words_((size + 63) / 64) {}
+
+    bool operator[](size_t v) const {
+        return words_[v / 64] >> (v % 64) & 1;
+    }
+
+    void set(size_t v) {
+        words_[v / 64] |= uint64_t{1} << (v % 64);
+    }
+
+    void reset(size_t v) {
+        words_[v / 64] &= ~(uint64_t{1} << (v % 64));
+    }
+
+    VregSet& operator|=(VregSet const& other) {
+        for (size_t i = 0; i < words_.size(); ++i) {
+            words_[i] |= other.words_[i];
+        }
+        return *this;
+    }
+
+    bool operator==(VregSet const&) const = default;
+
+    void for_each(auto const& f) const {
+        for (size_t i = 0; i < words_.size(); ++i) {
+            for (uint64_t word = words_[i]; word != 0; word &= word - 1) {
+                f(i * 64 + std::countr_zero(word));
+            }
+        }
+    }
+
+private:
+    std::vector<uint64_t> words_;
+};
+
+// Estimated runs of code nested in `loop_depth` loops per run of the function
+inline double frequency(size_t loop_depth) {
+    return std::pow(10.0, static_cast<double>(std::min<size_t>(loop_depth, 6)));
+}
+
+// How a call whose result is returned right away is compiled
+enum class TailCall {
+    None,
+    // Call of the function itself: reassigns the arguments and jumps back to the start
+    Loop,
+    // Tears down the frame and jumps, so that the callee returns to the current caller
+    Jump,
+};
+
+struct IrNode {
+    size_t offset;
+    // Basic block the node belongs to
+    size_t block{};
+    Instruction const* inst;
+    InstInfo info;
+    // Operand stack before the instruction, bottom to top
+    std::vector<size_t> entry_stack{};
+    // Stack values read (popped or peeked) and pushed, the latter in push order
+    std::vector<size_t> uses{};
+    std::vector<size_t> defs{};
+    // Set when the instruction pushes copies of its operands by renaming them and needs no
+    // code; it then has no uses or defs
+    bool renamed{};
+    // Variable read or written
+    std::optional<size_t> var_read{};
+    std::optional<size_t> var_write{};
+    // Variables read without being pushed: those a closure captures, and the closure the
+    // function was called through where a captured variable is loaded or stored
+    std::vector<size_t> closure_reads{};
+    // Indices of the successor and predecessor nodes
+    std::vector<size_t> succs{};
+    std::vector<size_t> preds{};
+    size_t loop_depth{};
+    VregSet live_in{};
+    VregSet live_out{};
+    TailCall tail_call{};
+    // Argument variables a Loop tail call writes, by argument number
+    std::vector<std::optional<size_t>> loop_args{};
+};
+
+// Maximal run of nodes in bytecode order that is entered only at its first node and left only
+// from its last one
+struct BasicBlock {
+    // Indices of the first and the last node
+    size_t first;
+    size_t last;
+    // Indices of the successor and predecessor blocks
+    std::vector<size_t> succs{};
+    std::vector<size_t> preds{};
+    // Immediate dominator; none for the entry block and for blocks no longer reachable from
+    // it, which tail calls may leave behind
+    std::optional<size_t> idom{};
+    // Operand stack height on entry
+    size_t entry_height{};
+    // Number of natural loops containing the block
+    size_t loop_depth{};
+};
+
+// One function in bytecode order, restricted to the reachable instructions.
+//
+// Every local and argument the function refers to and every operand stack value is a
+// virtual register (vreg). Variables come first, stack values follow. Stack values that
+// meet at a join point are merged into one vreg, so an operand keeps a single location
+// no matter which path produced it.
+class FunctionIR {
+public:
+    std::vector<IrNode> nodes{};
+    // Control-flow graph over the nodes; the entry block comes first
+    std::vector<BasicBlock> blocks{};
+    // Reachable blocks in reverse postorder
+    std::vector<size_t> block_order{};
+    std::vector<LocationEntry> variables{};
+    // Variable holding the closure the function was called through, if it refers to captured
+    // variables; its entry in `variables` is the captured variable -1
+    std::optional<size_t> closure{};
+    size_t vregs_count{};
+    // Value every definition of a stack vreg agrees on, if it is a compile-time constant
+    std::vector<std::optional<int64_t>> constants{};
+    // Function every definition of a vreg agrees on, as the bytecode offset of its BEGIN, if
+    // the vreg only holds closures that CLOSURE instructions of this function build
+    std::vector<std::optional<size_t>> closure_entries{};
+
+    // `body` is the function's instructions in bytecode order, starting with its BEGIN
+    static FunctionIR build(std::vector<std::pair<size_t, Instruction const*>> const& body);
+
+    bool is_variable(size_t vreg) const {
+        return vreg < variables.size();
+    }
+
+    std::optional<int64_t> constant(size_t vreg) const {
+        return is_variable(vreg) ? std::nullopt : constants[vreg - variables.size()];
+    }
+
+    std::optional<size_t> variable(LocationEntry entry) const;
+
+    std::optional<size_t> closure_entry(size_t vreg) const {
+        return closure_entries[vreg];
+    }
+
+    // Whether every path from the entry to block `b` passes through block `a`
+    bool dominates(size_t a, size_t b) const {
+        for (std::optional<size_t> block = b; block; block = blocks[*block].idom) {
+            if (*block == a) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Stack values and variables the node reads and writes
+    void for_each_use(IrNode const& node, auto const& f) const {
+        for (auto vreg : node.uses) {
+            f(vreg);
+        }
+        if (node.var_read) {
+            f(*node.var_read);
+        }
+        for (auto vreg : node.closure_reads) {
+            f(vreg);
+        }
+    }
+
+    void for_each_def(IrNode const& node, auto const& f) const {
+        for (auto vreg : node.defs) {
+            f(vreg);
+        }
+        if (node.var_write) {
+            f(*node.var_write);
+        }
+        for (auto const& arg : node.loop_args) {
+            if (arg) {
+                f(*arg);
+            }
+        }
+    }
+
+private:
+    bool returns_result_of(size_t index) const;
+    void mark_tail_calls();
+    void build_blocks();
+    void compute_dominators();
+    void compute_constants();
+    void compute_closure_entries();
+    void compute_loop_depth();
+    void compute_liveness();
+};
+
+}  // namespace lama::rv
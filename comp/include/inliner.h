@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "instruction.h"
+
+namespace lama {
+
+// Instructions of one function in bytecode order, starting with its BEGIN
+using FunctionBody = std::vector<std::pair<size_t, Instruction const*>>;
+
+// Replaces calls of small functions with copies of their bodies.
+//
+// The arguments and locals of the callee become fresh locals of the caller: a copy starts by
+// storing the arguments, and each of its ENDs jumps to the instruction after the call with
+// the result left on the stack. Copied instructions get offsets past the end of the
+// bytecode, so that their labels stay unique. Calls inside a copy are not expanded again.
+class Inliner {
+public:
+    // Callees with more instructions than this stay calls
+    static constexpr size_t max_callee_size = 16;
+    // Instructions the copies may add to one function
+    static constexpr size_t max_growth = 256;
+
+    // `functions` must outlive the inliner; `end_offset` is past every instruction offset
+    Inliner(std::vector<FunctionBody> const& functions, size_t end_offset);
+
+    // `body` with the calls of small functions expanded
+    FunctionBody expand(FunctionBody const& body);
+
+private:
+    // Bodies of the functions that may be copied, by the offset of their BEGIN
+    std::unordered_map<size_t, FunctionBody const*> candidates_{};
+    std::vector<std::unique_ptr<Instruction>> copies_{};
+    size_t next_offset_;
+};
+
+}  // namespace lama
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <variant>
+#include "register.h"
+
+namespace lama::rv {
+
+// name, mnemonic, opcode, funct3, funct7; the shifted adds are Zba and minu is Zbb
+#define RV_R_INSNS(MACRO)                   \
+    MACRO(Add, add, 0b0110011, 0x0, 0x00)   \
+    MACRO(Sub, sub, 0b0110011, 0x0, 0x20)   \
+    MACRO(Sll, sll, 0b0110011, 0x1, 0x00)   \
+    MACRO(Slt, slt, 0b0110011, 0x2, 0x00)   \
+    MACRO(Sltu, sltu, 0b0110011, 0x3, 0x00) \
+    MACRO(Xor, xor, 0b0110011, 0x4, 0x00)   \
+    MACRO(Srl, srl, 0b0110011, 0x5, 0x00)   \
+    MACRO(Sra, sra, 0b0110011, 0x5, 0x20)   \
+    MACRO(Or, or, 0b0110011, 0x6, 0x00)     \
+    MACRO(And, and, 0b0110011, 0x7, 0x00)   \
+    MACRO(Mul, mul, 0b0110011, 0x0, 0x01)   \
+    MACRO(Mulh, mulh, 0b0110011, 0x1, 0x01) \
+    MACRO(Div, div, 0b0110011, 0x4, 0x01)   \
+    MACRO(Rem, rem, 0b0110011, 0x6, 0x01)   \
+    MACRO(Sh1add, sh1add, 0b0110011, 0x2, 0x10) \
+    MACRO(Sh2add, sh2add, 0b0110011, 0x4, 0x10) \
+    MACRO(Sh3add, sh3add, 0b0110011, 0x6, 0x10) \
+    MACRO(Minu, minu, 0b0110011, 0x5, 0x05)
+
+// name, mnemonic, opcode, funct3, imm[11:6] for shifts
+#define RV_I_INSNS(MACRO)                    \
+    MACRO(Addi, addi, 0b0010011, 0x0, 0x00)  \
+    MACRO(Slti, slti, 0b0010011, 0x2, 0x00)  \
+    MACRO(Sltiu, sltiu, 0b0010011, 0x3, 0x00) \
+    MACRO(Xori, xori, 0b0010011, 0x4, 0x00)  \
+    MACRO(Ori, ori, 0b0010011, 0x6, 0x00)    \
+    MACRO(Andi, andi, 0b0010011, 0x7, 0x00)  \
+    MACRO(Slli, slli, 0b0010011, 0x1, 0x00)  \
+    MACRO(Srli, srli, 0b0010011, 0x5, 0x00)  \
+    MACRO(Srai, srai, 0b0010011, 0x5, 0x10)  \
+    MACRO(Addiw, addiw, 0b0011011, 0x0, 0x00)
+
+// name, mnemonic, opcode, funct3
+#define RV_LOAD_INSNS(MACRO)          \
+    MACRO(Lb, lb, 0b0000011, 0x0)     \
+    MACRO(Lbu, lbu, 0b0000011, 0x4)   \
+    MACRO(Ld, ld, 0b0000011, 0x3)
+
+#define RV_STORE_INSNS(MACRO)         \
+    MACRO(Sb, sb, 0b0100011, 0x0)     \
+    MACRO(Sd, sd, 0b0100011, 0x3)
+
+#define RV_BRANCH_INSNS(MACRO)        \
+    MACRO(Beq, beq, 0b1100011, 0x0)   \
+    MACRO(Bne, bne, 0b1100011, 0x1)   \
+    MACRO(Blt, blt, 0b1100011, 0x4)   \
+    MACRO(Bge, bge, 0b1100011, 0x5)   \
+    MACRO(Bltu, bltu, 0b1100011, 0x6) \
+    MACRO(Bgeu, bgeu, 0b1100011, 0x7)
+
+// name, mnemonic, opcode
+#define RV_U_INSNS(MACRO)              \
+    MACRO(Lui, lui, 0b0110111)         \
+    MACRO(Auipc, auipc, 0b0010111)
+
+#define RV_JUMP_INSNS(MACRO)           \
+    MACRO(Jal, jal, 0b1101111)         \
+    MACRO(Jalr, jalr, 0b1100111)
+
+// Instructions the assembler expands into one or more machine instructions
+#define RV_PSEUDO_INSNS(MACRO) \
+    MACRO(Li, li)              \
+    MACRO(La, la)              \
+    MACRO(Mv, mv)              \
+    MACRO(Seqz, seqz)          \
+    MACRO(Snez, snez)          \
+    MACRO(Sgt, sgt)            \
+    MACRO(Call, call)          \
+    MACRO(Tail, tail)          \
+    MACRO(Ret, ret)            \
+    MACRO(J, j)                \
+    MACRO(SdSymbol, sd)
+
+#define RV_ENUM_ENTRY(name, ...) name,
+
+enum class Op : uint8_t {
+    RV_R_INSNS(RV_ENUM_ENTRY)      //
+    RV_I_INSNS(RV_ENUM_ENTRY)      //
+    RV_LOAD_INSNS(RV_ENUM_ENTRY)   //
+    RV_STORE_INSNS(RV_ENUM_ENTRY)  //
+    RV_BRANCH_INSNS(RV_ENUM_ENTRY) //
+    RV_U_INSNS(RV_ENUM_ENTRY)      //
+    RV_JUMP_INSNS(RV_ENUM_ENTRY)   //
+    RV_PSEUDO_INSNS(RV_ENUM_ENTRY) //
+};
+
+#undef RV_ENUM_ENTRY
+
+// Case labels for a group of instructions, as in RV_BRANCH_INSNS(RV_OP_CASE)
+#define RV_OP_CASE(name, ...) case Op::name:
+
+#define RV_OP_IS(name, ...) op == Op::name ||
+
+constexpr bool is_branch(Op op) {
+    return RV_BRANCH_INSNS(RV_OP_IS) false;
+}
+
+constexpr bool is_store(Op op) {
+    return RV_STORE_INSNS(RV_OP_IS) false;
+}
+
+#undef RV_OP_IS
+
+char const* mnemonic(Op op);
+
+// Branch taken exactly when `op` is not
+Op inverted_branch(Op op);
+
+// A single instruction of the generated program.
+// Loads and stores keep their base in `rs1` and the stored register in `rs2`;
+// `symbol` names the label of branches, jumps, calls and symbol references.
+struct Insn {
+    Op op;
+    Register rd{0};
+    Register rs1{0};
+    Register rs2{0};
+    int64_t imm{0};
+    std::string symbol{};
+};
+
+struct Label {
+    std::string name;
+};
+
+struct Comment {
+    std::string text;
+};
+
+struct Section {
+    std::string name;
+};
+
+struct Global {
+    std::string name;
+};
+
+// `count` items of `size` bytes each holding `value`
+struct DataFill {
+    size_t count;
+    size_t size;
+    int64_t value;
+};
+
+// NUL-terminated string
+struct DataString {
+    std::string value;
+};
+
+// Alignment to 2^log2 bytes
+struct DataAlign {
+    size_t log2;
+};
+
+// Doubleword holding the address of a symbol
+struct DataAddress {
+    std::string symbol;
+};
+
+using Item = std::variant<Insn, Label, Comment, Section, Global, DataFill, DataString, DataAlign, DataAddress>;
+
+enum class OutputFormat { Asm, Object };
+
+// Extensions beyond RV64IM the generated code may use
+struct TargetFeatures {
+    // C: 16-bit forms of common instructions
+    bool compressed{};
+    // Zba: shifted adds for address arithmetic
+    bool zba{};
+    // Zbb: basic bit manipulation
+    bool zbb{};
+};
+
+// Features of an ISA string in the form -march takes, such as rv64imc or rv64gc_zba_zbb
+TargetFeatures parse_march(std::string_view isa);
+
+}  // namespace lama::rv
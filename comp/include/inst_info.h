@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+#include "opcode.h"
+
+namespace lama {
+
+namespace rv {
+// Lama function called through a closure, which the calling instruction does not name
+struct ClosureCallee {};
+
+// Runtime function name, bytecode offset of a Lama function, or the function of a closure
+using Callee = std::variant<std::string, size_t, ClosureCallee>;
+}  // namespace rv
+
+// What the per-function analyses need to know about an instruction
+struct InstInfo {
+    // Operand stack entries consumed and produced
+    size_t pops{};
+    size_t pushes{};
+    // Entries at the top of the stack read without being popped
+    size_t peeks{};
+    // Pushed entries that merely copy operands, as the depth of the copied entry before the
+    // instruction (0 is the top); such instructions may be compiled as a renaming
+    std::vector<size_t> copies{};
+    // Bytecode offset of the jump target
+    std::optional<size_t> jump_target{};
+    // Local, argument or captured variable read or written
+    std::optional<LocationEntry> reads{};
+    std::optional<LocationEntry> writes{};
+    // Variables copied into the closure the instruction builds, and the bytecode offset of
+    // the function the closure runs
+    std::vector<LocationEntry> captures{};
+    std::optional<size_t> closure_entry{};
+    // Function called by the generated code
+    std::optional<rv::Callee> callee{};
+};
+
+}  // namespace lama
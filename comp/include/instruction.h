@@ -1,8 +1,12 @@
 #pragma once
 
 #include <glog/logging.h>
+#include <cstdint>
+#include <optional>
 #include <ostream>
+#include <vector>
 #include "compiler.h"
+#include "inst_info.h"
 
 namespace lama {
 
@@ -10,11 +14,37 @@ class Instruction {
 public:
     virtual void print(std::ostream&) const = 0;
     virtual void emit_code(rv::Compiler*) const = 0;
+    virtual InstInfo info() const = 0;
+
+    // Value of the single pushed entry if it is known at compile time, given what is known
+    // about the operands (peeked entries, then popped ones, topmost first)
+    virtual std::optional<int64_t> constant_result(std::vector<std::optional<int64_t>> const&) const {
+        return std::nullopt;
+    }
 
     virtual bool is_terminator() const {
         return false;
     }
 
+    virtual bool is_function_entry() const {
+        return false;
+    }
+
+    // Plain call of a function, which may be compiled as a tail call
+    virtual bool is_call() const {
+        return false;
+    }
+
+    // Returns the popped value to the caller
+    virtual bool is_function_exit() const {
+        return false;
+    }
+
+    // Entry of the whole program, whose exit also turns the result into an exit code
+    virtual bool is_program_entry() const {
+        return false;
+    }
+
     virtual ~Instruction() = default;
 };
 
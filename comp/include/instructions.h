@@ -39,21 +39,25 @@ namespace lama {
     MACRO(BuiltinString)    \
     MACRO(BuiltinArray)
 
+using SymbolicLocation = rv::SymbolicStack::Loc;
 using SymbolicLocationType = rv::SymbolicStack::LocType;
 
 class Const : public Instruction {
 private:
-    int _value;
+    // Boxed, which needs more than the 32 bits of the operand
+    int64_t _value;
 
 public:
     Const(int value)
-        : _value(BOX(value)) {}
+        : _value(BOX(static_cast<int64_t>(value))) {}
 
-    inline int value() {
+    inline int64_t value() {
         return _value;
     }
 
     void print(std::ostream&) const override;
+    InstInfo info() const override;
+    std::optional<int64_t> constant_result(std::vector<std::optional<int64_t>> const& operands) const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
@@ -68,6 +72,7 @@ public:
         , _str(str) {}
 
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
@@ -85,49 +90,64 @@ public:
         return _name;
     }
 
-    inline size_t size() {
+    inline size_t size() const {
         return _size;
     }
 
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
 class StoreStack : public Instruction {
 public:
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
 class StoreArray : public Instruction {
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
 class End : public Instruction {
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
     bool is_terminator() const override {
         return true;
     }
+    bool is_function_exit() const override {
+        return true;
+    }
 };
 
 class Return : public Instruction {
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
 class Duplicate : public Instruction {
 public:
     void print(std::ostream&) const override;
+    InstInfo info() const override;
+    std::optional<int64_t> constant_result(std::vector<std::optional<int64_t>> const& operands) const override;
     void emit_code(rv::Compiler* c) const override {
-        c->cb.symb_emit_mv(c->st.alloc(), c->st.peek());
+        if (c->ir->nodes[c->node_index].renamed) {
+            return;
+        }
+        auto const src = c->st.peek();
+        c->cb.symb_emit_mv(c->st.alloc(), src);
     }
 };
 
 class Drop : public Instruction {
 public:
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override {
         c->st.pop();
     }
@@ -135,11 +155,13 @@ public:
 
 class Swap : public Instruction {
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
 class Elem : public Instruction {
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
@@ -151,7 +173,12 @@ public:
     Jump(int target)
         : _target(target) {}
 
+    inline size_t target() const {
+        return _target;
+    }
+
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
     bool is_terminator() const override {
         return true;
@@ -168,13 +195,21 @@ public:
         : _target(target)
         , _zero(zero) {}
 
+    inline size_t target() const {
+        return _target;
+    }
+
+    inline bool on_zero() const {
+        return _zero;
+    }
+
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
 class CBegin : public Instruction {
 private:
-    size_t offset;
     size_t _argc, _locc;
 
 public:
@@ -182,7 +217,11 @@ public:
         : _argc(argc)
         , _locc(locc) {}
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
+    bool is_function_entry() const override {
+        return true;
+    }
 };
 
 class Begin : public Instruction {
@@ -201,7 +240,23 @@ public:
         , _locc(locc) {}
 
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
+    bool is_function_entry() const override {
+        return true;
+    }
+    bool is_program_entry() const override {
+        auto const* name = std::get_if<std::string>(&_id);
+        return name != nullptr && *name == "main";
+    }
+
+    inline size_t argc() const {
+        return _argc;
+    }
+
+    inline size_t locc() const {
+        return _locc;
+    }
 };
 
 class Closure : public Instruction {
@@ -214,6 +269,7 @@ public:
         : _offset(offset)
         , _entries(entries) {}
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
@@ -226,12 +282,13 @@ public:
         : _argc(argc) {}
 
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
 class Call : public Instruction {
 private:
-    std::variant<std::string, size_t> _callee;
+    rv::Callee _callee;
     size_t _argc;
 
 public:
@@ -243,7 +300,11 @@ public:
         , _argc(argc) {}
 
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
+    bool is_call() const override {
+        return true;
+    }
 };
 
 class Tag : public Instruction {
@@ -257,6 +318,7 @@ public:
         , _size(size) {}
 
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
@@ -269,6 +331,7 @@ public:
         : _size(size) {}
 
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
@@ -282,6 +345,7 @@ public:
         , _col(col) {}
 
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
     bool is_terminator() const override { return true; }
 };
@@ -294,6 +358,7 @@ public:
     Line(int line)
         : _line(line) {}
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override {
         c->cb.emit_comment(std::format("LINE {:d}", _line));
     }
@@ -307,6 +372,8 @@ public:
     Binop(::BinopKind op)
         : _op(op) {}
     void print(std::ostream&) const override;
+    InstInfo info() const override;
+    std::optional<int64_t> constant_result(std::vector<std::optional<int64_t>> const& operands) const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
@@ -318,7 +385,12 @@ public:
     Load(LocationEntry loc)
         : _loc(loc) {}
 
+    inline LocationEntry location() const {
+        return _loc;
+    }
+
     void print(std::ostream&) const override;
+    InstInfo info() const override;
 
     void emit_code(rv::Compiler* c) const override;
 };
@@ -334,6 +406,7 @@ public:
         , _loc((Location)location) {}
 
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
@@ -345,7 +418,12 @@ public:
     Store(LocationEntry loc)
         : _loc(loc) {}
 
+    inline LocationEntry location() const {
+        return _loc;
+    }
+
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
@@ -356,13 +434,20 @@ private:
 public:
     PatternInst(int type)
         : _type(Pattern(type)) {}
+
+    inline Pattern type() const {
+        return _type;
+    }
+
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
 class BuiltinRead : public Instruction {
 public:
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override {
         c->compile_call("Lread", 0);
     }
@@ -370,6 +455,7 @@ public:
 
 class BuiltinWrite : public Instruction {
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override {
         c->compile_call("Lwrite", 1);
     }
@@ -377,11 +463,13 @@ class BuiltinWrite : public Instruction {
 
 class BuiltinLength : public Instruction {
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
 class BuiltinString : public Instruction {
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
@@ -391,7 +479,13 @@ class BuiltinArray : public Instruction {
 public:
     BuiltinArray(size_t len)
         : _len(len) {}
+
+    inline size_t length() const {
+        return _len;
+    }
+
     void print(std::ostream&) const override;
+    InstInfo info() const override;
     void emit_code(rv::Compiler* c) const override;
 };
 
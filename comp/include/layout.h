@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <unordered_map>
+#include <vector>
+#include "function_ir.h"
+
+namespace lama::rv {
+
+// How often each basic block ran, by the bytecode offset of its first instruction, as
+// written by a program compiled with --profile-generate
+using Profile = std::unordered_map<size_t, uint64_t>;
+
+// Reads lines of a block offset and its count
+Profile read_profile(std::istream& in);
+
+// Order in which to emit the blocks of `ir`, the entry block first.
+//
+// Without a profile the blocks keep their bytecode order. With one, every block is followed
+// by its most frequent successor not placed yet, so that hot paths fall through; blocks
+// that never ran or that end in FAIL go last.
+std::vector<size_t> layout_blocks(FunctionIR const& ir, Profile const* profile);
+
+}  // namespace lama::rv
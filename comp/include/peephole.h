@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+#include "insn.h"
+
+namespace lama::rv {
+
+// name, what it rewrites
+#define PEEPHOLES(MACRO)                                   \
+    MACRO(MoveToSelf, "mv x, x")                           \
+    MACRO(MoveBack, "mv a, b; mv b, a")                    \
+    MACRO(StoreLoad, "sd r, off(base); ld r', off(base)")  \
+    MACRO(StackAdjust, "addi sp, sp, a; addi sp, sp, b")   \
+    MACRO(JumpToNext, "j to the label that follows")       \
+    MACRO(BranchOverJump, "b<cond> next; j target; next:")
+
+enum class Peephole {
+#define PEEPHOLE_ENUM_ENTRY(name, ...) name,
+    PEEPHOLES(PEEPHOLE_ENUM_ENTRY)
+#undef PEEPHOLE_ENUM_ENTRY
+};
+
+#define PEEPHOLE_COUNT(...) +1
+constexpr size_t peephole_count = 0 PEEPHOLES(PEEPHOLE_COUNT);
+#undef PEEPHOLE_COUNT
+
+// How many times each pattern fired
+struct PeepholeStats {
+    std::array<size_t, peephole_count> hits{};
+
+    void hit(Peephole p) {
+        ++hits[static_cast<size_t>(p)];
+    }
+};
+
+std::ostream& operator<<(std::ostream& os, PeepholeStats const& stats);
+
+// Rewrites adjacent instructions of `items` until no pattern applies. Comments and labels
+// nothing refers to are transparent; other labels and data end a window, as control may
+// enter there.
+void run_peephole(std::vector<Item>& items, PeepholeStats& stats);
+
+}  // namespace lama::rv
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "function_ir.h"
+#include "register.h"
+#include "symb_stack.h"
+
+namespace lama::rv {
+
+// Object built in the frame instead of the heap
+struct FrameObject {
+    // Slot of the data header, the lowest word of the object
+    size_t header_slot;
+    // Slots of the words holding values, which the collector must see
+    std::vector<size_t> value_slots{};
+};
+
+struct Allocation {
+    // Location of every vreg of the function
+    std::vector<SymbolicStack::Loc> locs;
+    // Frame slots below fp the function needs
+    size_t slots_count;
+    // Objects built in the frame, by the index of the node building each
+    std::unordered_map<size_t, FrameObject> frame_objects{};
+    // STRING nodes that push the static copy of their literal, as nothing writes to or keeps it
+    std::unordered_set<size_t> shared_strings{};
+    // Vregs holding integers unboxed
+    VregSet unboxed{};
+};
+
+// Linear-scan register allocation over the live intervals of `ir`.
+//
+// Intervals that cross a call prefer callee-saved registers, the others take temporaries
+// first. When registers run out the interval with the lowest spill weight (uses and
+// definitions weighted by loop depth, per unit of length) goes to the frame. Constant
+// stack values get no location at all and are rematerialized by their users.
+Allocation allocate_registers(FunctionIR const& ir);
+
+// Renames the callee-saved registers of `allocation` so that the one used most, weighted by
+// loop depth, is s1: compressed instructions only name x8-x15, and of those the allocator
+// has s1 alone, as s0 is the frame pointer and a0-a5 pass arguments.
+void favor_compressible_registers(Allocation& allocation, FunctionIR const& ir);
+
+}  // namespace lama::rv
@@ -12,6 +12,8 @@ struct Register {
 
 public:
 
+    constexpr bool operator==(Register const&) const = default;
+
     static constexpr Register zero() {
         return {0};
     }
@@ -33,6 +35,10 @@ public:
     static constexpr Register fp() {
         return {8};
     }
+    // Closure a function is called through, as in GCC's static chain
+    static constexpr Register closure() {
+        return {7};
+    }
     static Register arg(size_t argno) {
         DCHECK_LT(argno, 8) << "argument register number out of range";
         return {(size_t)(10 + argno)};
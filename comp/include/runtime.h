@@ -5,4 +5,20 @@
 
 namespace lama {    
 int64_t LtagHash(const char* s);
+
+// Heap object layout, see runtime/runtime_common.h. Object pointers point at the contents,
+// preceded by the data header (tag in the low 3 bits, length above) and the forward address.
+constexpr int64_t STRING_TAG = 1;
+constexpr int64_t ARRAY_TAG = 3;
+constexpr int64_t SEXP_TAG = 5;
+constexpr int64_t CLOSURE_TAG = 7;
+constexpr int DATA_HEADER_OFFSET = -16;
+constexpr int FORWARD_ADDRESS_OFFSET = -8;
+// A sexp keeps its constructor tag in the first word of the contents
+constexpr int SEXP_FIELDS_OFFSET = 8;
+
+// Bump allocator of the collector, `memory_chunk heap` in runtime/gc.c
+constexpr char const* HEAP_SYMBOL = "heap";
+constexpr int HEAP_END_OFFSET = 8;
+constexpr int HEAP_CURRENT_OFFSET = 16;
 }
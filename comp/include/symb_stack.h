@@ -1,63 +1,96 @@
 #pragma once
 #include <glog/logging.h>
-#include <array>
 #include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
+#include "register.h"
 
 namespace lama::rv {
 class SymbolicStack {
 public:
-    enum class LocType { Register, Memory };
+    // Memory locations are frame slots: slot `n` lives at `-n * WORD_SIZE(fp)`.
+    // Constant locations hold values that are rematerialized on every use.
+    enum class LocType { Register, Memory, Constant };
 
     struct Loc {
         LocType type;
         size_t number;
-    };
+        int64_t value{};
 
-    constexpr static auto regs = std::to_array<size_t>({9, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 6, 7, 28, 29});
+        static Loc reg(Register r) {
+            return {.type = LocType::Register, .number = r.regno};
+        }
 
-    int top;
-    SymbolicStack()
-        : top(0) {}
+        static Loc slot(size_t n) {
+            return {.type = LocType::Memory, .number = n};
+        }
 
-    Loc alloc() {
-        if (top >= regs.size()) {
-            return Loc{.type = LocType::Memory, .number = top++ - regs.size()};
-        } else {
-            return Loc{.type = LocType::Register, .number = regs[top++]};
+        static Loc constant(int64_t value) {
+            return {.type = LocType::Constant, .number = 0, .value = value};
         }
+
+        bool operator==(Loc const&) const = default;
+    };
+
+    // Locations of the entries, bottom to top
+    std::vector<Loc> entries{};
+
+    // Starts an instruction: `entry` is the stack it sees, `defs` are the locations
+    // the register allocator chose for the values it pushes, in push order
+    void reset(std::vector<Loc> entry, std::vector<Loc> defs) {
+        entries = std::move(entry);
+        defs_ = std::move(defs);
+        next_def_ = 0;
     }
 
-    void push(Loc) {
-        top++;
+    size_t size() const {
+        return entries.size();
     }
 
-    size_t spilled_count() {
-        return (top > regs.size()) ? top - regs.size() : 0;
+    Loc alloc() {
+        DCHECK_LT(next_def_, defs_.size()) << "instruction pushes more values than analysed";
+        entries.push_back(defs_[next_def_]);
+        return defs_[next_def_++];
+    }
+
+    // Pushes an operand that only exists within the current instruction
+    void push_constant(int64_t value) {
+        entries.push_back(Loc::constant(value));
     }
 
     Loc peek() {
-        DCHECK_GT(top, 0) << "peek at empty symbolic stack";
-        if (top - 1 >= regs.size()) {
-            return Loc{.type = LocType::Memory, .number = top - 1 - regs.size()};
-        } else {
-            return Loc{.type = LocType::Register, .number = regs[top - 1]};
-        }
+        DCHECK_GT(entries.size(), 0) << "peek at empty symbolic stack";
+        return entries.back();
     }
 
     Loc pop() {
-        DCHECK_GT(top, 0) << "pop from empty symbolic stack";
-        if (--top >= regs.size()) {
-            return Loc{.type = LocType::Memory, .number = top - regs.size()};
-        } else {
-            return Loc{.type = LocType::Register, .number = regs[top]};
-        }
+        DCHECK_GT(entries.size(), 0) << "pop from empty symbolic stack";
+        auto const top = entries.back();
+        entries.pop_back();
+        return top;
     }
+
+private:
+    std::vector<Loc> defs_{};
+    size_t next_def_{};
 };
 
+// Frame layout: spilled values in slots right below fp, then the registers the function saves,
+// up from the word at sp. Stack arguments are above fp. Which registers are saved is only
+// known once the code of the function is generated, so the prologue and the epilogues are
+// inserted afterwards at the recorded positions in the code buffer.
 struct FrameInfo {
+    // fp-relative offset of a slot
+    static constexpr int offset(size_t slot) {
+        return -static_cast<int>(slot) * WORD_SIZE;
+    }
+
     std::string function_name;
-    size_t locals_count;
-    size_t args_count;
+    // Frame slots below fp, as placed by the register allocator
+    size_t slots_count;
+    // Where the prologue and the epilogues go
+    size_t prologue;
+    std::vector<size_t> epilogues{};
 };
 }  // namespace lama::rv
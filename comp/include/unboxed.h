@@ -0,0 +1,16 @@
+#pragma once
+
+#include "function_ir.h"
+
+namespace lama::rv {
+
+// Vregs of `ir` to keep as unboxed integers.
+//
+// A vreg can be unboxed when every definition of it is known to produce an integer and only
+// arithmetic, comparisons, conditional jumps and copies to or from variables touch it. Copies
+// box or unbox the value when the two sides disagree, so a loop counter can stay unboxed
+// while a call still receives it boxed. Vregs linked by such copies are unboxed together,
+// when the arithmetic done on them outweighs the conversions, both weighted by loop depth.
+VregSet unboxed_integers(FunctionIR const& ir);
+
+}  // namespace lama::rv
@@ -0,0 +1,49 @@
+#include "callees.h"
+
+#include <string>
+#include <string_view>
+#include <variant>
+#include "cpp.h"
+
+namespace lama::rv {
+
+namespace {
+
+RegisterSet caller_saved() {
+    RegisterSet regs;
+    regs.set(rv::Register::ra().regno);
+    rv::Register::temp_apply([&regs](rv::Register const& r, int) { regs.set(r.regno); });
+    rv::Register::arg_apply([&regs](rv::Register const& r, int) { regs.set(r.regno); });
+    return regs;
+}
+
+// Lama functions keep the globals pointer and save the callee-saved registers in their own
+// frame, where the collector finds them
+CalleeEffects lama_function_effects() {
+    auto clobbers = caller_saved();
+    clobbers.reset(rv::Register::gp().regno);
+    return CalleeEffects{.clobbers = clobbers, .may_collect = false};
+}
+
+}  // namespace
+
+CalleeEffects callee_effects(Callee const& callee) {
+    return std::visit(
+        overloads{
+            [](std::string const& name) {
+#define RUNTIME_FUNCTION_EFFECTS(function, collects)                               \
+    if (name == #function) {                                                       \
+        return CalleeEffects{.clobbers = caller_saved(), .may_collect = collects}; \
+    }
+                RUNTIME_FUNCTIONS(RUNTIME_FUNCTION_EFFECTS)
+#undef RUNTIME_FUNCTION_EFFECTS
+                return CalleeEffects{.clobbers = caller_saved(), .may_collect = true};
+            },
+            [](size_t) { return lama_function_effects(); },
+            [](ClosureCallee) { return lama_function_effects(); },
+        },
+        callee
+    );
+}
+
+}  // namespace lama::rv
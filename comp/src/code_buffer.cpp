@@ -0,0 +1,239 @@
+#include "code_buffer.h"
+
+#include <glog/logging.h>
+#include <format>
+#include <string_view>
+#include "cpp.h"
+#include "elf_writer.h"
+
+namespace lama::rv {
+
+char const* mnemonic(Op op) {
+    switch (op) {
+#define RV_MNEMONIC(name, rv_insn, ...) \
+    case Op::name:                      \
+        return #rv_insn;
+        RV_R_INSNS(RV_MNEMONIC)
+        RV_I_INSNS(RV_MNEMONIC)
+        RV_LOAD_INSNS(RV_MNEMONIC)
+        RV_STORE_INSNS(RV_MNEMONIC)
+        RV_BRANCH_INSNS(RV_MNEMONIC)
+        RV_U_INSNS(RV_MNEMONIC)
+        RV_JUMP_INSNS(RV_MNEMONIC)
+        RV_PSEUDO_INSNS(RV_MNEMONIC)
+#undef RV_MNEMONIC
+    }
+    LOG(FATAL) << "unknown instruction";
+    return nullptr;
+}
+
+Op inverted_branch(Op op) {
+    switch (op) {
+    case Op::Beq:
+        return Op::Bne;
+    case Op::Bne:
+        return Op::Beq;
+    case Op::Blt:
+        return Op::Bge;
+    case Op::Bge:
+        return Op::Blt;
+    case Op::Bltu:
+        return Op::Bgeu;
+    case Op::Bgeu:
+        return Op::Bltu;
+    RV_R_INSNS(RV_OP_CASE)
+    RV_I_INSNS(RV_OP_CASE)
+    RV_LOAD_INSNS(RV_OP_CASE)
+    RV_STORE_INSNS(RV_OP_CASE)
+    RV_U_INSNS(RV_OP_CASE)
+    RV_JUMP_INSNS(RV_OP_CASE)
+    RV_PSEUDO_INSNS(RV_OP_CASE)
+        break;
+    }
+    LOG(FATAL) << std::format("{} is not a branch", mnemonic(op));
+    return op;
+}
+
+TargetFeatures parse_march(std::string_view isa) {
+    CHECK(isa.starts_with("rv64")) << "not a 64-bit RISC-V target: " << isa;
+    TargetFeatures target;
+    bool base = false, multiply = false;
+    auto const underscore = isa.find('_');
+    // Single-letter extensions first, then multi-letter ones separated by underscores
+    for (char ext : isa.substr(4, underscore == std::string_view::npos ? std::string_view::npos : underscore - 4)) {
+        switch (ext) {
+        case 'g':
+            base = multiply = true;
+            break;
+        case 'i':
+            base = true;
+            break;
+        case 'm':
+            multiply = true;
+            break;
+        case 'a':
+        case 'f':
+        case 'd':
+            break;
+        case 'c':
+            target.compressed = true;
+            break;
+        default:
+            LOG(FATAL) << std::format("unsupported extension {} in {}", ext, isa);
+        }
+    }
+    CHECK(base && multiply) << "the generated code needs RV64IM: " << isa;
+    for (auto rest = underscore == std::string_view::npos ? std::string_view{} : isa.substr(underscore + 1);
+         !rest.empty();) {
+        auto const end = rest.find('_');
+        auto const ext = rest.substr(0, end);
+        if (ext == "zba") {
+            target.zba = true;
+        } else if (ext == "zbb") {
+            target.zbb = true;
+        } else {
+            CHECK(ext == "zicsr" || ext == "zifencei") << std::format("unsupported extension {} in {}", ext, isa);
+        }
+        rest = end == std::string_view::npos ? std::string_view{} : rest.substr(end + 1);
+    }
+    return target;
+}
+
+namespace {
+
+std::string escape(std::string_view str) {
+    std::string result;
+    for (char c : str) {
+        switch (c) {
+        case '\\':
+            result += "\\\\";
+            break;
+        case '"':
+            result += "\\\"";
+            break;
+        case '\n':
+            result += "\\n";
+            break;
+        case '\t':
+            result += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20 || static_cast<unsigned char>(c) >= 0x7f) {
+                result += std::format("\\{:03o}", static_cast<unsigned char>(c));
+            } else {
+                result += c;
+            }
+        }
+    }
+    return result;
+}
+
+std::string format_insn(Insn const& insn) {
+    auto const mn = mnemonic(insn.op);
+    switch (insn.op) {
+#define RV_FORMAT_R(name, ...) case Op::name:
+        RV_R_INSNS(RV_FORMAT_R)
+#undef RV_FORMAT_R
+    case Op::Sgt:
+        return std::format("{}\t{},\t{},\t{}", mn, insn.rd, insn.rs1, insn.rs2);
+
+#define RV_FORMAT_I(name, ...) case Op::name:
+        RV_I_INSNS(RV_FORMAT_I)
+#undef RV_FORMAT_I
+        return std::format("{}\t{},\t{},\t{}", mn, insn.rd, insn.rs1, insn.imm);
+
+#define RV_FORMAT_LOAD(name, ...) case Op::name:
+        RV_LOAD_INSNS(RV_FORMAT_LOAD)
+#undef RV_FORMAT_LOAD
+        return std::format("{}\t{},\t{}({})", mn, insn.rd, insn.imm, insn.rs1);
+
+#define RV_FORMAT_STORE(name, ...) case Op::name:
+        RV_STORE_INSNS(RV_FORMAT_STORE)
+#undef RV_FORMAT_STORE
+        return std::format("{}\t{},\t{}({})", mn, insn.rs2, insn.imm, insn.rs1);
+
+#define RV_FORMAT_BRANCH(name, ...) case Op::name:
+        RV_BRANCH_INSNS(RV_FORMAT_BRANCH)
+#undef RV_FORMAT_BRANCH
+        return std::format("{}\t{},\t{},\t{}", mn, insn.rs1, insn.rs2, insn.symbol);
+
+    case Op::Lui:
+    case Op::Auipc:
+    case Op::Li:
+        return std::format("{}\t{},\t{}", mn, insn.rd, insn.imm);
+    case Op::Jal:
+        return std::format("{}\t{},\t{}", mn, insn.rd, insn.symbol);
+    case Op::Jalr:
+        return std::format("{}\t{},\t{}({})", mn, insn.rd, insn.imm, insn.rs1);
+    case Op::La:
+        return std::format("{}\t{},\t{}", mn, insn.rd, insn.symbol);
+    case Op::Mv:
+    case Op::Seqz:
+    case Op::Snez:
+        return std::format("{}\t{},\t{}", mn, insn.rd, insn.rs1);
+    case Op::Call:
+    case Op::Tail:
+    case Op::J:
+        return std::format("{}\t{}", mn, insn.symbol);
+    case Op::Ret:
+        return mn;
+    case Op::SdSymbol:
+        return std::format("{}\t{},\t{},\t{}", mn, insn.rs2, insn.symbol, insn.rd);
+    }
+    LOG(FATAL) << "unknown instruction";
+    return {};
+}
+
+}  // namespace
+
+void CodeBuffer::write_asm(std::ostream& os) const {
+    if (target_.compressed) {
+        os << ".option rvc\n";
+    }
+    for (auto const& item : items_) {
+        std::visit(
+            overloads{
+                [&](Insn const& insn) { os << format_insn(insn) << '\n'; },
+                [&](Label const& label) { os << label.name << ":\n"; },
+                [&](Comment const& comment) { os << "# " << comment.text << '\n'; },
+                [&](Section const& section) {
+                    if (section.name == ".text" || section.name == ".data") {
+                        os << section.name << '\n';
+                    } else if (section.name == ".rodata") {
+                        os << ".section " << section.name << '\n';
+                    } else {
+                        os << ".section " << section.name << ",\"aw\",@progbits\n";
+                    }
+                },
+                [&](Global const& global) { os << ".global " << global.name << '\n'; },
+                [&](DataFill const& fill) {
+                    os << std::format(".fill {}, {}, {}\n", fill.count, fill.size, fill.value);
+                },
+                [&](DataString const& str) { os << ".asciz \"" << escape(str.value) << "\"\n"; },
+                // .align takes a power of two on RISC-V
+                [&](DataAlign const& align) { os << ".align " << align.log2 << '\n'; },
+                [&](DataAddress const& address) { os << ".dword " << address.symbol << '\n'; },
+            },
+            item
+        );
+    }
+    os.flush();
+}
+
+void CodeBuffer::flush() {
+    run_peephole(items_, peephole_stats_);
+    if (measure_code_size_) {
+        code_sizes_ = rv::measure_code_size(items_, functions_);
+    }
+    switch (format_) {
+    case OutputFormat::Asm:
+        write_asm(out_);
+        break;
+    case OutputFormat::Object:
+        write_object(items_, out_, target_);
+        break;
+    }
+    items_.clear();
+}
+
+}  // namespace lama::rv
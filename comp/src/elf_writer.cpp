@@ -0,0 +1,918 @@
+#include "elf_writer.h"
+
+#include <elf.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <format>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include "cpp.h"
+#include "encoding.h"
+
+namespace lama::rv {
+
+namespace {
+
+static_assert(std::endian::native == std::endian::little, "ELF writer assumes a little-endian host");
+
+struct Relocation {
+    uint64_t offset;
+    uint32_t type;
+    std::string symbol;
+};
+
+struct SectionData {
+    std::string name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t align;
+    std::vector<uint8_t> bytes{};
+    std::vector<Relocation> relocations{};
+};
+
+struct SymbolDef {
+    std::string name;
+    size_t section;
+    uint64_t value;
+};
+
+// Text section item with its current layout decision
+struct Fragment {
+    Insn const* insn;
+    uint64_t offset{};
+    uint64_t size{};
+    // Conditional branch lowered to an inverted branch over a `jal`
+    bool is_long{};
+    // Jump or branch still in its 16-bit form
+    bool is_compressed{};
+};
+
+uint32_t encode(Insn const& insn, int64_t pc_offset = 0) {
+    switch (insn.op) {
+#define RV_ENCODE_R(name, _, opcode, funct3, funct7) \
+    case Op::name:                                   \
+        return encode_r(opcode, funct3, funct7, insn.rd, insn.rs1, insn.rs2);
+        RV_R_INSNS(RV_ENCODE_R)
+#undef RV_ENCODE_R
+
+#define RV_ENCODE_I(name, _, opcode, funct3, shift_funct) \
+    case Op::name:                                        \
+        return encode_i(opcode, funct3, insn.rd, insn.rs1, (shift_funct) << 6 | insn.imm);
+        RV_I_INSNS(RV_ENCODE_I)
+#undef RV_ENCODE_I
+
+#define RV_ENCODE_LOAD(name, _, opcode, funct3) \
+    case Op::name:                              \
+        return encode_i(opcode, funct3, insn.rd, insn.rs1, insn.imm);
+        RV_LOAD_INSNS(RV_ENCODE_LOAD)
+#undef RV_ENCODE_LOAD
+
+#define RV_ENCODE_STORE(name, _, opcode, funct3) \
+    case Op::name:                               \
+        return encode_s(opcode, funct3, insn.rs1, insn.rs2, insn.imm);
+        RV_STORE_INSNS(RV_ENCODE_STORE)
+#undef RV_ENCODE_STORE
+
+#define RV_ENCODE_BRANCH(name, _, opcode, funct3) \
+    case Op::name:                                \
+        return encode_b(opcode, funct3, insn.rs1, insn.rs2, pc_offset);
+        RV_BRANCH_INSNS(RV_ENCODE_BRANCH)
+#undef RV_ENCODE_BRANCH
+
+#define RV_ENCODE_U(name, _, opcode) \
+    case Op::name:                   \
+        return encode_u(opcode, insn.rd, insn.imm);
+        RV_U_INSNS(RV_ENCODE_U)
+#undef RV_ENCODE_U
+
+    case Op::Jal:
+        return encode_j(0b1101111, insn.rd, pc_offset);
+    case Op::Jalr:
+        return encode_i(0b1100111, 0x0, insn.rd, insn.rs1, insn.imm);
+    RV_PSEUDO_INSNS(RV_OP_CASE)
+        break;
+    }
+    LOG(FATAL) << std::format("{} is not a machine instruction", mnemonic(insn.op));
+    return 0;
+}
+
+// Bits hi..lo of `value`
+constexpr uint32_t bits(int64_t value, unsigned hi, unsigned lo) {
+    return static_cast<uint32_t>(static_cast<uint64_t>(value) >> lo & ((uint64_t{1} << (hi - lo + 1)) - 1));
+}
+
+// Registers the 3-bit fields of compressed instructions name
+bool is_primed(Register r) {
+    return 8 <= r.regno && r.regno < 16;
+}
+
+uint32_t primed(Register r) {
+    return static_cast<uint32_t>(r.regno - 8);
+}
+
+bool is_scaled(int64_t value, unsigned scale, int64_t limit) {
+    return 0 <= value && value < limit && value % scale == 0;
+}
+
+// The 16-bit form of a machine instruction, if the C extension has one. Where several forms
+// apply, the one the assembler picks is used, so that objects match those it makes.
+std::optional<uint16_t> compress(Insn const& insn, int64_t pc_offset = 0) {
+    auto const rd = insn.rd, rs1 = insn.rs1, rs2 = insn.rs2;
+    auto const zero = Register::zero(), sp = Register::sp();
+    int64_t const imm = insn.imm;
+    switch (insn.op) {
+    case Op::Addi:
+        if (is_primed(rd) && rs1 == sp && imm != 0 && is_scaled(imm, 4, 1024)) {
+            return encode_ciw(
+                0b00, 0x0, primed(rd), bits(imm, 5, 4) << 6 | bits(imm, 9, 6) << 2 | bits(imm, 2, 2) << 1 | bits(imm, 3, 3)
+            );
+        }
+        if (rd == rs1 && rd != zero && imm != 0 && fits_signed(imm, 6)) {
+            return encode_ci(0b01, 0x0, rd, bits(imm, 5, 5), bits(imm, 4, 0));
+        }
+        if (rs1 == zero && rd != zero && fits_signed(imm, 6)) {
+            return encode_ci(0b01, 0x2, rd, bits(imm, 5, 5), bits(imm, 4, 0));
+        }
+        if (rd == sp && rs1 == sp && imm != 0 && imm % 16 == 0 && fits_signed(imm, 10)) {
+            return encode_ci(
+                0b01, 0x3, sp, bits(imm, 9, 9),
+                bits(imm, 4, 4) << 4 | bits(imm, 6, 6) << 3 | bits(imm, 8, 7) << 1 | bits(imm, 5, 5)
+            );
+        }
+        if (imm == 0 && rd != zero && rs1 != zero) {
+            return encode_cr(0b10, 0x8, rd, rs1);
+        }
+        return std::nullopt;
+    case Op::Addiw:
+        if (rd == rs1 && rd != zero && fits_signed(imm, 6)) {
+            return encode_ci(0b01, 0x1, rd, bits(imm, 5, 5), bits(imm, 4, 0));
+        }
+        return std::nullopt;
+    case Op::Lui:
+        if (rd != zero && rd != sp && imm != 0 && fits_signed(imm, 6)) {
+            return encode_ci(0b01, 0x3, rd, bits(imm, 5, 5), bits(imm, 4, 0));
+        }
+        return std::nullopt;
+    case Op::Slli:
+        if (rd == rs1 && rd != zero && imm != 0) {
+            return encode_ci(0b10, 0x0, rd, bits(imm, 5, 5), bits(imm, 4, 0));
+        }
+        return std::nullopt;
+    case Op::Srli:
+    case Op::Srai:
+    case Op::Andi: {
+        bool const fits = insn.op == Op::Andi ? fits_signed(imm, 6) : imm != 0;
+        if (rd != rs1 || !is_primed(rd) || !fits) {
+            return std::nullopt;
+        }
+        uint32_t const funct2 = insn.op == Op::Srli ? 0b00 : insn.op == Op::Srai ? 0b01 : 0b10;
+        return encode_cb(0b01, 0x4, primed(rd), bits(imm, 5, 5) << 2 | funct2, bits(imm, 4, 0));
+    }
+    case Op::Sub:
+    case Op::Xor:
+    case Op::Or:
+    case Op::And: {
+        uint32_t const funct2 = insn.op == Op::Sub ? 0b00 : insn.op == Op::Xor ? 0b01 : insn.op == Op::Or ? 0b10 : 0b11;
+        if (!is_primed(rd) || !is_primed(rs1) || !is_primed(rs2)) {
+            return std::nullopt;
+        }
+        if (rd == rs1) {
+            return encode_ca(0b01, 0b100011, funct2, primed(rd), primed(rs2));
+        }
+        // The others commute
+        if (rd == rs2 && insn.op != Op::Sub) {
+            return encode_ca(0b01, 0b100011, funct2, primed(rd), primed(rs1));
+        }
+        return std::nullopt;
+    }
+    case Op::Add:
+        if (rd == zero) {
+            return std::nullopt;
+        }
+        if (rs1 == zero && rs2 != zero) {
+            return encode_cr(0b10, 0x8, rd, rs2);
+        }
+        if (rd == rs1 && rs2 != zero) {
+            return encode_cr(0b10, 0x9, rd, rs2);
+        }
+        if (rd == rs2 && rs1 != zero) {
+            return encode_cr(0b10, 0x9, rd, rs1);
+        }
+        if (rs2 == zero && rs1 != zero) {
+            return encode_cr(0b10, 0x8, rd, rs1);
+        }
+        return std::nullopt;
+    case Op::Ld:
+        if (is_primed(rd) && is_primed(rs1) && is_scaled(imm, 8, 256)) {
+            return encode_cl(0b00, 0x3, primed(rd), primed(rs1), bits(imm, 5, 3), bits(imm, 7, 6));
+        }
+        if (rs1 == sp && rd != zero && is_scaled(imm, 8, 512)) {
+            return encode_ci(0b10, 0x3, rd, bits(imm, 5, 5), bits(imm, 4, 3) << 3 | bits(imm, 8, 6));
+        }
+        return std::nullopt;
+    case Op::Sd:
+        if (is_primed(rs2) && is_primed(rs1) && is_scaled(imm, 8, 256)) {
+            return encode_cl(0b00, 0x7, primed(rs2), primed(rs1), bits(imm, 5, 3), bits(imm, 7, 6));
+        }
+        if (rs1 == sp && is_scaled(imm, 8, 512)) {
+            return encode_css(0b10, 0x7, rs2, bits(imm, 5, 3) << 3 | bits(imm, 8, 6));
+        }
+        return std::nullopt;
+    case Op::Jalr:
+        if (imm == 0 && rs1 != zero && (rd == zero || rd == Register::ra())) {
+            return encode_cr(0b10, rd == zero ? 0x8 : 0x9, rs1, zero);
+        }
+        return std::nullopt;
+    case Op::Jal:
+        if (rd == zero && fits_signed(pc_offset, 12)) {
+            return encode_cj(
+                0b01, 0x5,
+                bits(pc_offset, 11, 11) << 10 | bits(pc_offset, 4, 4) << 9 | bits(pc_offset, 9, 8) << 7 |
+                    bits(pc_offset, 10, 10) << 6 | bits(pc_offset, 6, 6) << 5 | bits(pc_offset, 7, 7) << 4 |
+                    bits(pc_offset, 3, 1) << 1 | bits(pc_offset, 5, 5)
+            );
+        }
+        return std::nullopt;
+    case Op::Beq:
+    case Op::Bne:
+        if (is_primed(rs1) && rs2 == zero && fits_signed(pc_offset, 9)) {
+            return encode_cb(
+                0b01, insn.op == Op::Beq ? 0x6 : 0x7, primed(rs1), bits(pc_offset, 8, 8) << 2 | bits(pc_offset, 4, 3),
+                bits(pc_offset, 7, 6) << 3 | bits(pc_offset, 2, 1) << 1 | bits(pc_offset, 5, 5)
+            );
+        }
+        return std::nullopt;
+    case Op::Sll:
+    case Op::Slt:
+    case Op::Sltu:
+    case Op::Srl:
+    case Op::Sra:
+    case Op::Mul:
+    case Op::Mulh:
+    case Op::Div:
+    case Op::Rem:
+    case Op::Sh1add:
+    case Op::Sh2add:
+    case Op::Sh3add:
+    case Op::Minu:
+    case Op::Slti:
+    case Op::Sltiu:
+    case Op::Xori:
+    case Op::Ori:
+    case Op::Lb:
+    case Op::Lbu:
+    case Op::Sb:
+    case Op::Blt:
+    case Op::Bge:
+    case Op::Bltu:
+    case Op::Bgeu:
+    case Op::Auipc:
+    RV_PSEUDO_INSNS(RV_OP_CASE)
+        break;
+    }
+    return std::nullopt;
+}
+
+// Rewrites pseudo-instructions that do not reference symbols into machine instructions
+std::vector<Insn> expand(Insn const& insn) {
+    switch (insn.op) {
+    case Op::Li: {
+        std::vector<Insn> seq;
+        li_sequence(insn.rd, insn.imm, seq);
+        return seq;
+    }
+    case Op::Mv:
+        return {{.op = Op::Addi, .rd = insn.rd, .rs1 = insn.rs1}};
+    case Op::Seqz:
+        return {{.op = Op::Sltiu, .rd = insn.rd, .rs1 = insn.rs1, .imm = 1}};
+    case Op::Snez:
+        return {{.op = Op::Sltu, .rd = insn.rd, .rs1 = Register::zero(), .rs2 = insn.rs1}};
+    case Op::Sgt:
+        return {{.op = Op::Slt, .rd = insn.rd, .rs1 = insn.rs2, .rs2 = insn.rs1}};
+    case Op::Ret:
+        return {{.op = Op::Jalr, .rd = Register::zero(), .rs1 = Register::ra()}};
+    case Op::La:
+    case Op::Call:
+    case Op::Tail:
+    case Op::J:
+    case Op::SdSymbol:
+    RV_R_INSNS(RV_OP_CASE)
+    RV_I_INSNS(RV_OP_CASE)
+    RV_LOAD_INSNS(RV_OP_CASE)
+    RV_STORE_INSNS(RV_OP_CASE)
+    RV_BRANCH_INSNS(RV_OP_CASE)
+    RV_U_INSNS(RV_OP_CASE)
+    RV_JUMP_INSNS(RV_OP_CASE)
+        break;
+    }
+    return {insn};
+}
+
+class ObjectBuilder {
+public:
+    ObjectBuilder(std::vector<Item> const& items, TargetFeatures const& target) : target_(target) {
+        section_index(".text");
+        std::vector<Fragment> fragments;
+        // Labels are attached to the fragment that follows them
+        std::vector<std::pair<std::string, size_t>> text_labels;
+        size_t current = section_index(".text");
+        for (auto const& item : items) {
+            std::visit(
+                overloads{
+                    [&](Insn const& insn) {
+                        CHECK_EQ(current, text_) << std::format("instruction outside of .text: {}", mnemonic(insn.op));
+                        fragments.push_back({.insn = &insn, .is_compressed = target_.compressed});
+                    },
+                    [&](Label const& label) {
+                        if (current == text_) {
+                            text_labels.emplace_back(label.name, fragments.size());
+                        } else {
+                            define(label.name, current, sections_[current].bytes.size());
+                        }
+                    },
+                    [](Comment const&) {},
+                    [&](Section const& section) { current = section_index(section.name); },
+                    [&](Global const& global) { globals_.insert(global.name); },
+                    [&](DataFill const& fill) {
+                        CHECK_NE(current, text_) << "data in .text is not supported";
+                        auto& bytes = sections_[current].bytes;
+                        for (size_t i = 0; i < fill.count; ++i) {
+                            for (size_t b = 0; b < fill.size; ++b) {
+                                bytes.push_back(b < sizeof(int64_t) ? static_cast<uint8_t>(fill.value >> (8 * b)) : 0);
+                            }
+                        }
+                    },
+                    [&](DataString const& str) {
+                        CHECK_NE(current, text_) << "data in .text is not supported";
+                        auto& bytes = sections_[current].bytes;
+                        bytes.insert(bytes.end(), str.value.begin(), str.value.end());
+                        bytes.push_back(0);
+                    },
+                    [&](DataAlign const& align) {
+                        auto& section = sections_[current];
+                        uint64_t const alignment = uint64_t{1} << align.log2;
+                        section.align = std::max(section.align, alignment);
+                        section.bytes.resize((section.bytes.size() + alignment - 1) / alignment * alignment);
+                    },
+                    [&](DataAddress const& address) {
+                        CHECK_NE(current, text_) << "data in .text is not supported";
+                        relocate(current, R_RISCV_64, address.symbol);
+                        sections_[current].bytes.resize(sections_[current].bytes.size() + 8);
+                    },
+                },
+                item
+            );
+        }
+        layout_text(fragments, text_labels);
+    }
+
+    void write(std::ostream& out);
+
+    // Offset of a label in .text
+    uint64_t text_offset(std::string const& label) const {
+        auto it = text_label_offsets_.find(label);
+        CHECK(it != text_label_offsets_.end()) << std::format("undefined label {}", label);
+        return it->second;
+    }
+
+    uint64_t text_size() const {
+        return sections_[text_].bytes.size();
+    }
+
+private:
+    TargetFeatures target_;
+    std::vector<SectionData> sections_{};
+    std::vector<SymbolDef> defined_{};
+    std::unordered_map<std::string, size_t> symbol_index_{};
+    std::set<std::string> globals_{};
+    std::map<std::string, uint64_t> text_label_offsets_{};
+    size_t text_{};
+    size_t pcrel_count_{};
+
+    size_t section_index(std::string const& name) {
+        for (size_t i = 0; i < sections_.size(); ++i) {
+            if (sections_[i].name == name) {
+                return i;
+            }
+        }
+        if (name == ".text") {
+            text_ = sections_.size();
+            uint64_t const align = target_.compressed ? 2 : 4;
+            sections_.push_back({.name = name, .type = SHT_PROGBITS, .flags = SHF_ALLOC | SHF_EXECINSTR, .align = align});
+        } else if (name == ".rodata") {
+            sections_.push_back({.name = name, .type = SHT_PROGBITS, .flags = SHF_ALLOC, .align = 8});
+        } else {
+            sections_.push_back({.name = name, .type = SHT_PROGBITS, .flags = SHF_ALLOC | SHF_WRITE, .align = 8});
+        }
+        return sections_.size() - 1;
+    }
+
+    void define(std::string const& name, size_t section, uint64_t value) {
+        auto [it, inserted] = symbol_index_.emplace(name, defined_.size());
+        CHECK(inserted) << std::format("symbol {} is defined twice", name);
+        defined_.push_back({.name = name, .section = section, .value = value});
+    }
+
+    // Jumps and branches that have a 16-bit form when the target is near enough
+    static bool has_compressed_form(Insn const& insn) {
+        auto const beqz = Insn{.op = insn.op, .rs1 = insn.rs1, .rs2 = insn.rs2};
+        return insn.op == Op::J || ((insn.op == Op::Beq || insn.op == Op::Bne) && compress(beqz).has_value());
+    }
+
+    uint64_t machine_size(Insn const& insn) const {
+        return target_.compressed && compress(insn) ? 2 : 4;
+    }
+
+    uint64_t fragment_size(Fragment const& f) const {
+        Insn const& insn = *f.insn;
+        switch (insn.op) {
+        case Op::La:
+        case Op::Call:
+        case Op::Tail:
+        case Op::SdSymbol:
+            return 8;
+        case Op::J:
+            return f.is_compressed ? 2 : 4;
+        RV_BRANCH_INSNS(RV_OP_CASE)
+            return f.is_long ? 8 : f.is_compressed ? 2 : 4;
+        case Op::Li:
+        case Op::Mv:
+        case Op::Seqz:
+        case Op::Snez:
+        case Op::Sgt:
+        case Op::Ret:
+        RV_R_INSNS(RV_OP_CASE)
+        RV_I_INSNS(RV_OP_CASE)
+        RV_LOAD_INSNS(RV_OP_CASE)
+        RV_STORE_INSNS(RV_OP_CASE)
+        RV_U_INSNS(RV_OP_CASE)
+        RV_JUMP_INSNS(RV_OP_CASE)
+            break;
+        }
+        uint64_t size = 0;
+        for (auto const& machine_insn : expand(insn)) {
+            size += machine_size(machine_insn);
+        }
+        return size;
+    }
+
+    int64_t target_offset(Fragment const& f) const {
+        auto it = text_label_offsets_.find(f.insn->symbol);
+        CHECK(it != text_label_offsets_.end()) << std::format("undefined label {}", f.insn->symbol);
+        return static_cast<int64_t>(it->second) - static_cast<int64_t>(f.offset);
+    }
+
+    // Assigns offsets, growing out-of-range branches until the layout is stable. With the C
+    // extension jumps and branches start out in their 16-bit forms
+    void layout_text(std::vector<Fragment>& fragments, std::vector<std::pair<std::string, size_t>> const& labels) {
+        for (auto& f : fragments) {
+            f.is_compressed = f.is_compressed && has_compressed_form(*f.insn);
+        }
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            uint64_t offset = 0;
+            size_t next_label = 0;
+            text_label_offsets_.clear();
+            for (size_t i = 0; i <= fragments.size(); ++i) {
+                for (; next_label < labels.size() && labels[next_label].second == i; ++next_label) {
+                    text_label_offsets_[labels[next_label].first] = offset;
+                }
+                if (i == fragments.size()) {
+                    break;
+                }
+                fragments[i].offset = offset;
+                fragments[i].size = fragment_size(fragments[i]);
+                offset += fragments[i].size;
+            }
+            for (auto& f : fragments) {
+                if (f.is_compressed && !fits_signed(target_offset(f), f.insn->op == Op::J ? 12 : 9)) {
+                    f.is_compressed = false;
+                    changed = true;
+                } else if (is_branch(f.insn->op) && !f.is_long && !f.is_compressed && !fits_signed(target_offset(f), 13)) {
+                    f.is_long = true;
+                    changed = true;
+                }
+            }
+        }
+        for (auto const& [name, offset] : text_label_offsets_) {
+            define(name, text_, offset);
+        }
+        for (auto const& f : fragments) {
+            encode_fragment(f);
+        }
+    }
+
+    void put16(uint16_t half) {
+        auto& bytes = sections_[text_].bytes;
+        bytes.push_back(static_cast<uint8_t>(half));
+        bytes.push_back(static_cast<uint8_t>(half >> 8));
+    }
+
+    // The 16-bit form of `insn` if there is one and the target has the C extension
+    void put_machine(Insn const& insn, int64_t pc_offset = 0) {
+        if (target_.compressed) {
+            if (auto const half = compress(insn, pc_offset)) {
+                put16(*half);
+                return;
+            }
+        }
+        put(encode(insn, pc_offset));
+    }
+
+    void put(uint32_t word) {
+        auto& bytes = sections_[text_].bytes;
+        for (int b = 0; b < 4; ++b) {
+            bytes.push_back(static_cast<uint8_t>(word >> (8 * b)));
+        }
+    }
+
+    void relocate(uint32_t type, std::string symbol) {
+        relocate(text_, type, std::move(symbol));
+    }
+
+    // Relocation at the current end of `section`
+    void relocate(size_t section, uint32_t type, std::string symbol) {
+        sections_[section].relocations.push_back(
+            {.offset = sections_[section].bytes.size(), .type = type, .symbol = std::move(symbol)}
+        );
+    }
+
+    // auipc with a %pcrel_hi relocation; returns the local label the matching %pcrel_lo refers to
+    std::string emit_pcrel_hi(Register rd, std::string const& symbol) {
+        auto label = std::format(".Lpcrel_hi{}", pcrel_count_++);
+        define(label, text_, sections_[text_].bytes.size());
+        relocate(R_RISCV_PCREL_HI20, symbol);
+        put(encode({.op = Op::Auipc, .rd = rd}));
+        return label;
+    }
+
+    void encode_fragment(Fragment const& f) {
+        Insn const& insn = *f.insn;
+        DCHECK_EQ(sections_[text_].bytes.size(), f.offset);
+        switch (insn.op) {
+        case Op::La: {
+            // Code addresses are resolved here, as the assembler does without relaxation. It
+            // still numbers the %pcrel_hi label it then drops
+            if (text_label_offsets_.contains(insn.symbol)) {
+                ++pcrel_count_;
+                int64_t const offset = target_offset(f);
+                put(encode({.op = Op::Auipc, .rd = insn.rd, .imm = hi20(offset)}));
+                put(encode({.op = Op::Addi, .rd = insn.rd, .rs1 = insn.rd, .imm = lo12(offset)}));
+                return;
+            }
+            auto const hi = emit_pcrel_hi(insn.rd, insn.symbol);
+            relocate(R_RISCV_PCREL_LO12_I, hi);
+            put(encode({.op = Op::Addi, .rd = insn.rd, .rs1 = insn.rd}));
+            return;
+        }
+        case Op::SdSymbol: {
+            auto const hi = emit_pcrel_hi(insn.rd, insn.symbol);
+            relocate(R_RISCV_PCREL_LO12_S, hi);
+            put(encode({.op = Op::Sd, .rs1 = insn.rd, .rs2 = insn.rs2}));
+            return;
+        }
+        case Op::Call:
+        case Op::Tail: {
+            // A tail call goes through t1 and does not link
+            auto const link = insn.op == Op::Call ? Register::ra() : Register::zero();
+            auto const base = insn.op == Op::Call ? Register::ra() : Register{6};
+            if (text_label_offsets_.contains(insn.symbol)) {
+                int64_t const offset = target_offset(f);
+                put(encode({.op = Op::Auipc, .rd = base, .imm = hi20(offset)}));
+                put(encode({.op = Op::Jalr, .rd = link, .rs1 = base, .imm = lo12(offset)}));
+                return;
+            }
+            relocate(R_RISCV_CALL_PLT, insn.symbol);
+            put(encode({.op = Op::Auipc, .rd = base}));
+            put(encode({.op = Op::Jalr, .rd = link, .rs1 = base}));
+            return;
+        }
+        case Op::J: {
+            int64_t const offset = target_offset(f);
+            CHECK(fits_signed(offset, 21)) << std::format("jump to {} is out of range", insn.symbol);
+            Insn const jal{.op = Op::Jal, .rd = Register::zero()};
+            if (f.is_compressed) {
+                put16(*compress(jal, offset));
+            } else {
+                put(encode(jal, offset));
+            }
+            return;
+        }
+        RV_BRANCH_INSNS(RV_OP_CASE) {
+            int64_t const offset = target_offset(f);
+            if (f.is_compressed) {
+                put16(*compress(insn, offset));
+            } else if (!f.is_long) {
+                put(encode(insn, offset));
+            } else {
+                CHECK(fits_signed(offset - 4, 21)) << std::format("branch to {} is out of range", insn.symbol);
+                put(encode({.op = inverted_branch(insn.op), .rs1 = insn.rs1, .rs2 = insn.rs2}, 8));
+                put(encode({.op = Op::Jal, .rd = Register::zero()}, offset - 4));
+            }
+            return;
+        }
+        case Op::Li:
+        case Op::Mv:
+        case Op::Seqz:
+        case Op::Snez:
+        case Op::Sgt:
+        case Op::Ret:
+        RV_R_INSNS(RV_OP_CASE)
+        RV_I_INSNS(RV_OP_CASE)
+        RV_LOAD_INSNS(RV_OP_CASE)
+        RV_STORE_INSNS(RV_OP_CASE)
+        RV_U_INSNS(RV_OP_CASE)
+        RV_JUMP_INSNS(RV_OP_CASE)
+            break;
+        }
+        for (auto const& machine_insn : expand(insn)) {
+            put_machine(machine_insn);
+        }
+    }
+};
+
+template <typename T>
+void append(std::vector<uint8_t>& bytes, T const& value) {
+    auto const* raw = reinterpret_cast<uint8_t const*>(&value);
+    bytes.insert(bytes.end(), raw, raw + sizeof(T));
+}
+
+uint32_t add_string(std::vector<uint8_t>& table, std::string const& str) {
+    auto const offset = static_cast<uint32_t>(table.size());
+    table.insert(table.end(), str.begin(), str.end());
+    table.push_back(0);
+    return offset;
+}
+
+void ObjectBuilder::write(std::ostream& out) {
+    // Section header indices: null, content sections, their relocations, then the tables
+    std::vector<Elf64_Shdr> headers(1);
+    std::vector<std::vector<uint8_t> const*> contents(1);
+    std::vector<uint8_t> shstrtab{0};
+    std::vector<uint8_t> strtab{0};
+    std::vector<uint8_t> symtab;
+    std::vector<std::vector<uint8_t>> rela_contents;
+
+    auto const section_header_index = [](size_t section) { return static_cast<uint16_t>(section + 1); };
+
+    // Symbols: locals first, then globals (defined and undefined)
+    std::vector<Elf64_Sym> symbols(1);
+    std::unordered_map<std::string, uint32_t> elf_index;
+    std::vector<SymbolDef const*> global_defs;
+    std::unordered_set<std::string> relocated;
+    for (auto const& section : sections_) {
+        for (auto const& reloc : section.relocations) {
+            relocated.insert(reloc.symbol);
+        }
+    }
+    for (auto const& def : defined_) {
+        // As with the assembler, local labels are only kept when a relocation refers to them
+        if (def.name.starts_with(".L") && !relocated.contains(def.name)) {
+            continue;
+        }
+        if (globals_.contains(def.name)) {
+            global_defs.push_back(&def);
+            continue;
+        }
+        elf_index[def.name] = symbols.size();
+        symbols.push_back(
+            {.st_name = add_string(strtab, def.name),
+             .st_info = ELF64_ST_INFO(STB_LOCAL, STT_NOTYPE),
+             .st_other = STV_DEFAULT,
+             .st_shndx = section_header_index(def.section),
+             .st_value = def.value,
+             .st_size = 0}
+        );
+    }
+    auto const first_global = static_cast<uint32_t>(symbols.size());
+    for (auto const* def : global_defs) {
+        elf_index[def->name] = symbols.size();
+        symbols.push_back(
+            {.st_name = add_string(strtab, def->name),
+             .st_info = ELF64_ST_INFO(STB_GLOBAL, def->section == text_ ? STT_FUNC : STT_OBJECT),
+             .st_other = STV_DEFAULT,
+             .st_shndx = section_header_index(def->section),
+             .st_value = def->value,
+             .st_size = 0}
+        );
+    }
+    for (auto const& section : sections_) {
+        for (auto const& reloc : section.relocations) {
+            if (elf_index.contains(reloc.symbol)) {
+                continue;
+            }
+            elf_index[reloc.symbol] = symbols.size();
+            symbols.push_back(
+                {.st_name = add_string(strtab, reloc.symbol),
+                 .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE),
+                 .st_other = STV_DEFAULT,
+                 .st_shndx = SHN_UNDEF,
+                 .st_value = 0,
+                 .st_size = 0}
+            );
+        }
+    }
+    for (auto const& sym : symbols) {
+        append(symtab, sym);
+    }
+
+    for (auto const& section : sections_) {
+        headers.push_back(
+            {.sh_name = add_string(shstrtab, section.name),
+             .sh_type = section.type,
+             .sh_flags = section.flags,
+             .sh_addr = 0,
+             .sh_offset = 0,
+             .sh_size = section.bytes.size(),
+             .sh_link = 0,
+             .sh_info = 0,
+             .sh_addralign = section.align,
+             .sh_entsize = 0}
+        );
+        contents.push_back(&section.bytes);
+    }
+    auto const symtab_index = static_cast<uint32_t>(headers.size() + std::ranges::count_if(sections_, [](auto const& s) {
+                                                                        return !s.relocations.empty();
+                                                                    }) + 1);
+    rela_contents.reserve(sections_.size());
+    for (size_t i = 0; i < sections_.size(); ++i) {
+        if (sections_[i].relocations.empty()) {
+            continue;
+        }
+        auto& bytes = rela_contents.emplace_back();
+        for (auto const& reloc : sections_[i].relocations) {
+            append(
+                bytes,
+                Elf64_Rela{
+                    .r_offset = reloc.offset,
+                    .r_info = ELF64_R_INFO(elf_index.at(reloc.symbol), reloc.type),
+                    .r_addend = 0,
+                }
+            );
+        }
+        headers.push_back(
+            {.sh_name = add_string(shstrtab, ".rela" + sections_[i].name),
+             .sh_type = SHT_RELA,
+             .sh_flags = SHF_INFO_LINK,
+             .sh_addr = 0,
+             .sh_offset = 0,
+             .sh_size = bytes.size(),
+             .sh_link = symtab_index,
+             .sh_info = section_header_index(i),
+             .sh_addralign = 8,
+             .sh_entsize = sizeof(Elf64_Rela)}
+        );
+        contents.push_back(&bytes);
+    }
+    // Non-executable stack
+    static std::vector<uint8_t> const empty;
+    headers.push_back(
+        {.sh_name = add_string(shstrtab, ".note.GNU-stack"),
+         .sh_type = SHT_PROGBITS,
+         .sh_flags = 0,
+         .sh_addr = 0,
+         .sh_offset = 0,
+         .sh_size = 0,
+         .sh_link = 0,
+         .sh_info = 0,
+         .sh_addralign = 1,
+         .sh_entsize = 0}
+    );
+    contents.push_back(&empty);
+    CHECK_EQ(headers.size(), symtab_index);
+    headers.push_back(
+        {.sh_name = add_string(shstrtab, ".symtab"),
+         .sh_type = SHT_SYMTAB,
+         .sh_flags = 0,
+         .sh_addr = 0,
+         .sh_offset = 0,
+         .sh_size = symtab.size(),
+         .sh_link = symtab_index + 1,
+         .sh_info = first_global,
+         .sh_addralign = 8,
+         .sh_entsize = sizeof(Elf64_Sym)}
+    );
+    contents.push_back(&symtab);
+    headers.push_back(
+        {.sh_name = add_string(shstrtab, ".strtab"),
+         .sh_type = SHT_STRTAB,
+         .sh_flags = 0,
+         .sh_addr = 0,
+         .sh_offset = 0,
+         .sh_size = strtab.size(),
+         .sh_link = 0,
+         .sh_info = 0,
+         .sh_addralign = 1,
+         .sh_entsize = 0}
+    );
+    contents.push_back(&strtab);
+    auto const shstrtab_index = static_cast<uint16_t>(headers.size());
+    auto const shstrtab_name = add_string(shstrtab, ".shstrtab");
+    headers.push_back(
+        {.sh_name = shstrtab_name,
+         .sh_type = SHT_STRTAB,
+         .sh_flags = 0,
+         .sh_addr = 0,
+         .sh_offset = 0,
+         .sh_size = shstrtab.size(),
+         .sh_link = 0,
+         .sh_info = 0,
+         .sh_addralign = 1,
+         .sh_entsize = 0}
+    );
+    contents.push_back(&shstrtab);
+
+    std::vector<uint8_t> file(sizeof(Elf64_Ehdr));
+    for (size_t i = 1; i < headers.size(); ++i) {
+        auto const align = std::max<uint64_t>(headers[i].sh_addralign, 1);
+        file.resize((file.size() + align - 1) / align * align);
+        headers[i].sh_offset = file.size();
+        file.insert(file.end(), contents[i]->begin(), contents[i]->end());
+    }
+    file.resize((file.size() + 7) / 8 * 8);
+    uint64_t const shoff = file.size();
+    for (auto const& header : headers) {
+        append(file, header);
+    }
+
+    Elf64_Ehdr ehdr{};
+    std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_RISCV;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_shoff = shoff;
+    // The runtime is built for the lp64d ABI
+    ehdr.e_flags = EF_RISCV_FLOAT_ABI_DOUBLE | (target_.compressed ? EF_RISCV_RVC : 0);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = static_cast<uint16_t>(headers.size());
+    ehdr.e_shstrndx = shstrtab_index;
+    std::memcpy(file.data(), &ehdr, sizeof(ehdr));
+
+    out.write(reinterpret_cast<char const*>(file.data()), static_cast<std::streamsize>(file.size()));
+}
+
+}  // namespace
+
+void write_object(std::vector<Item> const& items, std::ostream& out, TargetFeatures const& target) {
+    ObjectBuilder builder{items, target};
+    builder.write(out);
+}
+
+CodeSizes measure_code_size(std::vector<Item> const& items, std::vector<std::string> const& functions) {
+    ObjectBuilder const full{items, {}};
+    ObjectBuilder const compressed{items, {.compressed = true}};
+    // Functions end where the next one in the code starts
+    auto const sizes_in = [&functions](ObjectBuilder const& builder) {
+        std::map<uint64_t, uint64_t> ends;
+        for (auto const& name : functions) {
+            ends.emplace(builder.text_offset(name), builder.text_size());
+        }
+        for (auto it = ends.begin(); it != ends.end() && std::next(it) != ends.end(); ++it) {
+            it->second = std::next(it)->first;
+        }
+        std::vector<uint64_t> sizes;
+        for (auto const& name : functions) {
+            auto const start = builder.text_offset(name);
+            sizes.push_back(ends.at(start) - start);
+        }
+        return sizes;
+    };
+    auto const full_sizes = sizes_in(full), compressed_sizes = sizes_in(compressed);
+    CodeSizes result;
+    for (size_t k = 0; k < functions.size(); ++k) {
+        result.functions.push_back({.name = functions[k], .full = full_sizes[k], .compressed = compressed_sizes[k]});
+    }
+    return result;
+}
+
+std::ostream& operator<<(std::ostream& os, CodeSizes const& sizes) {
+    uint64_t full = 0, compressed = 0;
+    auto const row = [&os](std::string_view name, uint64_t full, uint64_t compressed) {
+        double const saved = full == 0 ? 0.0 : 100.0 * static_cast<double>(full - compressed) / static_cast<double>(full);
+        os << std::format("{:<32} {:>8} {:>8} {:>6.1f}%\n", name, full, compressed, saved);
+    };
+    os << std::format("{:<32} {:>8} {:>8} {:>7}\n", "function", "rv64", "rv64c", "saved");
+    for (auto const& function : sizes.functions) {
+        row(function.name, function.full, function.compressed);
+        full += function.full;
+        compressed += function.compressed;
+    }
+    row("total", full, compressed);
+    return os;
+}
+
+}  // namespace lama::rv
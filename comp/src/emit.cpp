@@ -1,5 +1,14 @@
 #include <glog/logging.h>
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
 #include <variant>
+#include <vector>
 #include "compiler.h"
 #include "cpp.h"
 #include "instructions.h"
@@ -12,50 +21,326 @@ namespace lama {
 
 void Const::emit_code(rv::Compiler* c) const {
     auto loc = c->st.alloc();
+    auto const value = c->unboxed(c->ir->nodes[c->node_index].defs.front()) ? _value >> 1 : _value;
     switch (loc.type) {
     case SymbolicLocationType::Memory: {
-        c->cb.emit_li(rv::Register::temp1(), _value);
-        c->cb.emit_sd(rv::Register::temp1(), rv::Register::fp(), -loc.number * rv::WORD_SIZE);
+        c->cb.emit_li(rv::Register::temp1(), value);
+        c->cb.emit_sd(rv::Register::temp1(), rv::Register::fp(), rv::CodeBuffer::slot_offset(loc));
         break;
     }
     case SymbolicLocationType::Register: {
-        c->cb.emit_li({(uint8_t)loc.number}, _value);
+        c->cb.emit_li({loc.number}, value);
         break;
     }
+    case SymbolicLocationType::Constant:
+        // Rematerialized by the users
+        DCHECK_EQ(loc.value, _value);
+        break;
+    }
+}
+
+static bool fits_imm(int64_t value) {
+    return value >= -2048 && value < 2048;
+}
+
+// Integers the register allocation keeps unboxed are boxed as 2x + 1 where they meet code
+// that expects boxed values
+static void emit_box(rv::CodeBuffer& cb, rv::Register dest, rv::Register src) {
+    cb.emit_slli(dest, src, 1);
+    cb.emit_addi(dest, dest, 1);
+}
+
+static void emit_unbox(rv::CodeBuffer& cb, rv::Register dest, rv::Register src) {
+    cb.emit_srai(dest, src, 1);
+}
+
+// Register holding the value of vreg `v` at `loc`, unboxed or boxed as `unboxed` asks
+static rv::Register operand_reg(
+    rv::Compiler* c, SymbolicLocation const& loc, size_t v, bool unboxed, rv::Register temp
+) {
+    if (loc.type == SymbolicLocationType::Constant) {
+        auto const value = unboxed ? loc.value >> 1 : loc.value;
+        return value == 0 ? rv::Register::zero() : c->cb.to_reg(SymbolicLocation::constant(value), temp);
+    }
+    auto const reg = c->cb.to_reg(loc, temp);
+    if (c->unboxed(v) == unboxed) {
+        return reg;
+    }
+    if (unboxed) {
+        emit_unbox(c->cb, temp, reg);
+    } else {
+        emit_box(c->cb, temp, reg);
+    }
+    return temp;
+}
+
+// Copies the value of vreg `src` at `src_loc` to vreg `dst` at `dst_loc`, converting it if
+// only one of them is unboxed
+static void emit_copy(
+    rv::Compiler* c, SymbolicLocation const& dst_loc, size_t dst, SymbolicLocation const& src_loc, size_t src
+) {
+    if (dst_loc.type == SymbolicLocationType::Constant) {
+        return;
+    }
+    bool const unboxed = c->unboxed(dst);
+    if (src_loc.type == SymbolicLocationType::Constant || c->unboxed(src) == unboxed) {
+        bool const convert = src_loc.type == SymbolicLocationType::Constant && unboxed;
+        c->cb.symb_emit_mv(dst_loc, convert ? SymbolicLocation::constant(src_loc.value >> 1) : src_loc);
+        return;
+    }
+    auto const dest = c->cb.def_reg(dst_loc, rv::Register::temp1());
+    auto const value = c->cb.to_reg(src_loc, rv::Register::temp1());
+    if (unboxed) {
+        emit_unbox(c->cb, dest, value);
+    } else {
+        emit_box(c->cb, dest, value);
+    }
+    c->cb.commit(dst_loc, dest);
+}
+
+// Locations of the top `count` operands, deepest first
+static std::vector<SymbolicLocation> pop_operands(rv::Compiler* c, size_t count) {
+    std::vector<SymbolicLocation> operands(count);
+    for (auto& operand : operands | std::views::reverse) {
+        operand = c->st.pop();
+    }
+    return operands;
+}
+
+// Inline bump allocation of an object with `words` words of contents. `init(object)` fills
+// the contents, with `object` pointing at them and temp1 free. When the heap chunk is full
+// `slow()` calls the runtime constructor instead, which collects and leaves the object in
+// a0. Nothing can collect between bumping the pointer and writing the header. Objects that
+// do not escape are built in the frame, whose prologue already zeroed the forward address.
+template <typename Init, typename Slow>
+static void emit_allocation(
+    rv::Compiler* c, int64_t tag, size_t length, size_t words, Init const& init, Slow const& slow
+) {
+    auto const temp1 = rv::Register::temp1(), temp2 = rv::Register::temp2();
+    auto const object = rv::Register::arg(0), chunk = rv::Register::arg(1);
+    if (auto const* frame_object = c->frame_object()) {
+        auto const offset = rv::FrameInfo::offset(frame_object->header_slot) - DATA_HEADER_OFFSET;
+        if (fits_imm(offset)) {
+            c->cb.emit_addi(object, rv::Register::fp(), offset);
+        } else {
+            c->cb.emit_li(temp1, offset);
+            c->cb.emit_add(object, rv::Register::fp(), temp1);
+        }
+        c->cb.emit_li(temp1, static_cast<int64_t>(length << 3) | tag);
+        c->cb.emit_sd(temp1, object, DATA_HEADER_OFFSET);
+        init(object);
+        c->cb.symb_emit_mv(c->st.alloc(), object);
+        return;
+    }
+    auto const slow_label = c->new_label(), done = c->new_label();
+    auto const size = static_cast<int64_t>((words + 2) * rv::WORD_SIZE);
+    c->cb.emit_la(chunk, HEAP_SYMBOL);
+    c->cb.emit_ld(object, chunk, HEAP_CURRENT_OFFSET);
+    if (fits_imm(size)) {
+        c->cb.emit_addi(temp1, object, static_cast<int>(size));
+    } else {
+        c->cb.emit_li(temp1, size);
+        c->cb.emit_add(temp1, object, temp1);
+    }
+    c->cb.emit_ld(temp2, chunk, HEAP_END_OFFSET);
+    c->cb.emit_branch(rv::Op::Bltu, temp2, temp1, slow_label);
+    c->cb.emit_sd(temp1, chunk, HEAP_CURRENT_OFFSET);
+    c->cb.emit_addi(object, object, -DATA_HEADER_OFFSET);
+    c->cb.emit_li(temp1, static_cast<int64_t>(length << 3) | tag);
+    c->cb.emit_sd(temp1, object, DATA_HEADER_OFFSET);
+    c->cb.emit_sd(rv::Register::zero(), object, FORWARD_ADDRESS_OFFSET);
+    init(object);
+    c->cb.emit_j(done);
+    c->cb.emit_label(slow_label);
+    slow();
+    c->cb.emit_label(done);
+    c->cb.symb_emit_mv(c->st.alloc(), object);
+}
+
+// Stores the values at `fields` in consecutive words from `offset(object)`
+static void emit_fields(
+    rv::CodeBuffer& cb, rv::Register object, int offset, std::vector<SymbolicLocation> const& fields
+) {
+    for (size_t i = 0; i < fields.size(); ++i) {
+        auto const value = cb.to_reg(fields[i], rv::Register::temp1());
+        cb.emit_sd(value, object, offset + static_cast<int>(i * rv::WORD_SIZE));
     }
 }
 
+// Copies of string literals longer than this many words loop instead of being unrolled
+constexpr size_t max_unrolled_string_words = 8;
+
+// The literal is a heap-layout object in read-only data, used as it is where nothing writes
+// to or keeps the string, and copied into a new object otherwise
 void String::emit_code(rv::Compiler* c) const {
-    c->cb.symb_emit_la(c->st.alloc(), std::format("string_{}", _ind));
-    c->compile_call("RVBstring", 1);
+    auto const literal = std::format("string_{}", _ind);
+    if (c->allocation->shared_strings.contains(c->node_index)) {
+        c->cb.symb_emit_la(c->st.alloc(), literal);
+        return;
+    }
+    // The terminating NUL and the padding come along with the last word
+    size_t const words = (_str.size() + rv::WORD_SIZE) / rv::WORD_SIZE;
+    auto const temp1 = rv::Register::temp1(), source = rv::Register::temp2();
+    emit_allocation(
+        c,
+        STRING_TAG,
+        _str.size(),
+        words,
+        [&](rv::Register object) {
+            c->cb.emit_la(source, literal);
+            if (words <= max_unrolled_string_words) {
+                for (size_t k = 0; k < words; ++k) {
+                    auto const offset = static_cast<int>(k * rv::WORD_SIZE);
+                    c->cb.emit_ld(temp1, source, offset);
+                    c->cb.emit_sd(temp1, object, offset);
+                }
+                return;
+            }
+            // a1 and a2 are free once the object is allocated
+            auto const dest = rv::Register::arg(1), end = rv::Register::arg(2);
+            auto const loop = c->new_label();
+            c->cb.emit_mv(dest, object);
+            c->cb.emit_li(end, static_cast<int64_t>(words * rv::WORD_SIZE));
+            c->cb.emit_add(end, end, source);
+            c->cb.emit_label(loop);
+            c->cb.emit_ld(temp1, source, 0);
+            c->cb.emit_sd(temp1, dest, 0);
+            c->cb.emit_addi(source, source, rv::WORD_SIZE);
+            c->cb.emit_addi(dest, dest, rv::WORD_SIZE);
+            c->cb.emit_branch(rv::Op::Bltu, source, end, loop);
+        },
+        [&] { c->emit_call("RVBstring", {}, literal); }
+    );
 }
 
 void SExpression::emit_code(rv::Compiler* c) const {
-    c->cb.symb_emit_li(c->st.alloc(), lama::LtagHash(const_cast<char*>(_name)));
-    c->compile_call("RVBsexp", _size + 1, BOX(_size + 1));
+    auto const tag = lama::LtagHash(const_cast<char*>(_name));
+    auto args = pop_operands(c, _size);
+    emit_allocation(
+        c,
+        SEXP_TAG,
+        _size,
+        _size + 1,
+        [&](rv::Register object) {
+            // Sexps keep their tag unboxed
+            c->cb.emit_li(rv::Register::temp1(), tag >> 1);
+            c->cb.emit_sd(rv::Register::temp1(), object, 0);
+            emit_fields(c->cb, object, SEXP_FIELDS_OFFSET, args);
+        },
+        [&] {
+            args.push_back(SymbolicLocation::constant(tag));
+            c->emit_call("RVBsexp", args, static_cast<int64_t>(BOX(_size + 1)));
+        }
+    );
 }
 
 void StoreStack::emit_code(rv::Compiler* c) const {
     auto value_loc = c->st.pop();
     auto ptr_loc = c->st.pop();
-    c->st.push(value_loc);
     c->cb.symb_emit_sd(value_loc, ptr_loc, 0);
+    c->cb.symb_emit_mv(c->st.alloc(), value_loc);
+}
+
+// Inlined element access of Belem and Bsta. The aggregate is in `p` and the boxed index in
+// `i`. For arrays and sexps `word(base, offset)` emits the access to the element at
+// `offset(base)`, for strings `byte(base)` the access to the character at `0(base)`; temp1
+// is free in both. Unboxed aggregates, closures and, with `check_index`, unboxed indices
+// call `runtime` with the arguments in place instead. The fast paths jump to the returned
+// label, which the caller emits after taking the result of the call.
+template <typename Word, typename Byte>
+static std::string emit_element_access(
+    rv::Compiler* c,
+    rv::Register p,
+    rv::Register i,
+    bool check_index,
+    std::string_view runtime,
+    Word const& word,
+    Byte const& byte
+) {
+    auto const temp1 = rv::Register::temp1(), temp2 = rv::Register::temp2(), zero = rv::Register::zero();
+    auto const not_array = c->new_label(), not_sexp = c->new_label(), slow = c->new_label(), done = c->new_label();
+    if (check_index) {
+        c->cb.emit_andi(temp1, i, 1);
+        c->cb.emit_branch(rv::Op::Beq, temp1, zero, slow);
+    }
+    c->cb.emit_andi(temp1, p, 1);
+    c->cb.emit_branch(rv::Op::Bne, temp1, zero, slow);
+    c->cb.emit_ld(temp1, p, DATA_HEADER_OFFSET);
+    c->cb.emit_andi(temp1, temp1, 7);
+    // i * 4 == UNBOX(i) * WORD_SIZE + 4, which the offsets take back
+    c->cb.emit_shift_add(temp2, i, 2, p, temp2);
+    c->cb.emit_addi(temp1, temp1, -ARRAY_TAG);
+    c->cb.emit_branch(rv::Op::Bne, temp1, zero, not_array);
+    word(temp2, -4);
+    c->cb.emit_j(done);
+    c->cb.emit_label(not_array);
+    c->cb.emit_addi(temp1, temp1, ARRAY_TAG - SEXP_TAG);
+    c->cb.emit_branch(rv::Op::Bne, temp1, zero, not_sexp);
+    word(temp2, SEXP_FIELDS_OFFSET - 4);
+    c->cb.emit_j(done);
+    c->cb.emit_label(not_sexp);
+    c->cb.emit_addi(temp1, temp1, SEXP_TAG - STRING_TAG);
+    c->cb.emit_branch(rv::Op::Bne, temp1, zero, slow);
+    c->cb.emit_srai(temp2, i, 1);
+    c->cb.emit_add(temp2, temp2, p);
+    byte(temp2);
+    c->cb.emit_j(done);
+    c->cb.emit_label(slow);
+    c->call_in_place(std::string{runtime});
+    return done;
 }
 
 void StoreArray::emit_code(rv::Compiler* c) const {
-    c->compile_call("Bsta", 3);
+    auto const value = c->st.pop();
+    auto const index = c->st.pop();
+    auto const aggregate = c->st.pop();
+    auto const x = rv::Register::arg(0), i = rv::Register::arg(1), v = rv::Register::arg(2);
+    c->cb.symb_emit_mv(x, aggregate);
+    c->cb.symb_emit_mv(i, index);
+    c->cb.symb_emit_mv(v, value);
+    auto const dest = c->st.alloc();
+    // An unboxed index makes Bsta assign through a reference, which is left to the runtime
+    auto const done = emit_element_access(
+        c,
+        x,
+        i,
+        true,
+        "Bsta",
+        [&](rv::Register base, int offset) {
+            c->cb.emit_sd(v, base, offset);
+            c->cb.symb_emit_mv(dest, v);
+        },
+        [&](rv::Register base) {
+            c->cb.emit_srai(rv::Register::temp1(), v, 1);
+            c->cb.emit_sb(rv::Register::temp1(), base, 0);
+            c->cb.symb_emit_mv(dest, v);
+        }
+    );
+    c->cb.symb_emit_mv(dest, rv::Register::arg(0));
+    c->cb.emit_label(done);
 }
 
 void Jump::emit_code(rv::Compiler* c) const {
     c->cb.emit_j(c->label_for_ip(_target));
-    c->add_jump_target(_target, c->st.top);
 }
 
 void ConditionalJump::emit_code(rv::Compiler* c) const {
-    auto const reg = c->cb.to_reg(c->st.pop(), rv::Register::temp1());
-    c->cb.emit_srai(reg, reg, 1);
-    c->cb.emit_cj(_zero, reg, rv::Register::zero(), c->label_for_ip(_target));
-    c->add_jump_target(_target, c->st.top);
+    if (std::exchange(c->next_fused, false)) {
+        // The comparison before already branched
+        c->st.pop();
+        return;
+    }
+    auto const cond = c->st.pop();
+    if (cond.type == SymbolicLocationType::Constant) {
+        // Boxed zero is 1
+        if ((cond.value == 1) == _zero) {
+            c->cb.emit_j(c->label_for_ip(_target));
+        }
+        return;
+    }
+    auto const temp = rv::Register::temp1();
+    auto const value = operand_reg(c, cond, c->ir->nodes[c->node_index].uses.front(), true, temp);
+    c->cb.emit_cj(_zero, value, rv::Register::zero(), c->label_for_ip(_target));
 }
 
 void Return::emit_code(rv::Compiler*) const {
@@ -63,25 +348,94 @@ void Return::emit_code(rv::Compiler*) const {
 }
 
 void Swap::emit_code(rv::Compiler* c) const {
+    if (c->ir->nodes[c->node_index].renamed) {
+        return;
+    }
     auto const a = c->st.pop();
-    auto const b = c->st.peek();
-    auto const temp = rv::Register::temp1();
-    c->cb.symb_emit_mv(temp, a);
-    c->cb.symb_emit_mv(a, b);
-    c->cb.symb_emit_mv(b, temp);
-    c->st.push(a);
+    auto const b = c->st.pop();
+    auto const x = c->st.alloc();
+    auto const y = c->st.alloc();
+    c->cb.symb_emit_parallel_mv({{x, a}, {y, b}});
 }
 
 void Elem::emit_code(rv::Compiler* c) const {
-    c->compile_call("Belem", 2);
+    auto const index = c->st.pop();
+    auto const aggregate = c->st.pop();
+    auto const p = rv::Register::arg(0), i = rv::Register::arg(1);
+    c->cb.symb_emit_mv(p, aggregate);
+    c->cb.symb_emit_mv(i, index);
+    auto const dest = c->st.alloc();
+    auto const dest_reg = c->cb.def_reg(dest, rv::Register::temp1());
+    auto const done = emit_element_access(
+        c,
+        p,
+        i,
+        false,
+        "Belem",
+        [&](rv::Register base, int offset) {
+            c->cb.emit_ld(dest_reg, base, offset);
+            c->cb.commit(dest, dest_reg);
+        },
+        [&](rv::Register base) {
+            c->cb.emit_lbu(dest_reg, base, 0);
+            c->cb.emit_slli(dest_reg, dest_reg, 1);
+            c->cb.emit_addi(dest_reg, dest_reg, 1);
+            c->cb.commit(dest, dest_reg);
+        }
+    );
+    c->cb.symb_emit_mv(dest, rv::Register::arg(0));
+    c->cb.emit_label(done);
 }
 
-void Closure::emit_code(rv::Compiler*) const {
-    TODO();
+// Closure object: the code pointer, then the captured values. The slow path gets the
+// object from the runtime with the code pointer in place.
+void Closure::emit_code(rv::Compiler* c) const {
+    auto const temp1 = rv::Register::temp1();
+    auto const code = c->label_for_ip(_offset);
+    size_t const words = _entries.size() + 1;
+    auto const init = [&](rv::Register object, bool with_code) {
+        if (with_code) {
+            c->cb.emit_la(temp1, code);
+            c->cb.emit_sd(temp1, object, 0);
+        }
+        for (size_t j = 0; j < _entries.size(); ++j) {
+            auto const& entry = _entries[j];
+            auto const field = static_cast<int>((j + 1) * rv::WORD_SIZE);
+            switch (entry.kind) {
+            case Location::Global:
+                c->cb.emit_ld(temp1, rv::Register::gp(), entry.index * rv::WORD_SIZE);
+                c->cb.emit_sd(temp1, object, field);
+                break;
+            case Location::Local:
+            case Location::Arg: {
+                auto const v = c->ir->variable(entry);
+                c->cb.emit_sd(operand_reg(c, c->variable(entry), *v, false, temp1), object, field);
+                break;
+            }
+            case Location::Captured: {
+                auto const closure = c->cb.to_reg(c->closure(), temp1);
+                c->cb.emit_ld(temp1, closure, (entry.index + 1) * rv::WORD_SIZE);
+                c->cb.emit_sd(temp1, object, field);
+                break;
+            }
+            }
+        }
+    };
+    emit_allocation(
+        c,
+        CLOSURE_TAG,
+        words,
+        words,
+        [&](rv::Register object) { init(object, true); },
+        [&] {
+            c->emit_call("RVBclosure", {SymbolicLocation::constant(BOX(_entries.size()))}, code);
+            init(rv::Register::arg(0), false);
+        }
+    );
 }
 
 void CBegin::emit_code(rv::Compiler* c) const {
-    Begin(std::format("closure@{:#010x}", offset), _argc, _locc).emit_code(c);
+    Begin(c->ir->nodes[c->node_index].offset, _argc, _locc).emit_code(c);
 }
 
 void Begin::emit_code(rv::Compiler* c) const {
@@ -95,58 +449,170 @@ void Begin::emit_code(rv::Compiler* c) const {
         },
         _id
     );
-    c->current_frame = rv::FrameInfo{.function_name = name, .locals_count = _locc, .args_count = _argc};
+    c->cb.begin_function(name);
+    // The prologue goes here once the code of the function shows what it has to save
+    c->current_frame = rv::FrameInfo{
+        .function_name = name,
+        .slots_count = c->allocation->slots_count,
+        .prologue = c->cb.position(),
+    };
+    // The collector scans the frame, so slots must not hold stale pointers
+    for (size_t slot = 1; slot <= c->current_frame->slots_count; ++slot) {
+        c->cb.emit_sd(rv::Register::zero(), rv::Register::fp(), rv::FrameInfo::offset(slot));
+    }
     if (name == "main") {
-        c->cb.emit(c->premain());
-        c->compile_call("__init", 0);
+        DCHECK(std::ranges::none_of(c->ir->variables, [](auto const& v) { return v.kind == Location::Arg; }))
+            << "main arguments are not supported";
+        c->premain();
+    }
+    auto const& entry = c->ir->nodes.front();
+    if (auto const closure = c->ir->closure; closure && entry.live_out[*closure]) {
+        c->cb.symb_emit_mv(c->allocation->locs[*closure], rv::Register::closure());
+    }
+    // Locals read before they are written, like one holding a recursive local function that
+    // captures itself, start out as 0 in registers too
+    for (size_t v = 0; v < c->ir->variables.size(); ++v) {
+        auto const& loc = c->allocation->locs[v];
+        if (c->ir->variables[v].kind == Location::Local && entry.live_out[v] &&
+            loc.type == SymbolicLocationType::Register) {
+            c->cb.emit_mv(rv::Register{loc.number}, rv::Register::zero());
+        }
+    }
+    // Move arguments to where the register allocator placed them
+    for (size_t k = 0; k < _argc; ++k) {
+        auto const v = c->ir->variable({.kind = Location::Arg, .index = static_cast<int>(k)});
+        if (!v || !entry.live_out[*v]) {
+            continue;
+        }
+        auto const dst = c->allocation->locs[*v];
+        if (k < 8) {
+            c->cb.symb_emit_mv(dst, rv::Register::arg(k));
+        } else {
+            auto const temp = rv::Register::temp1();
+            c->cb.emit_ld(temp, rv::Register::fp(), (k - 8) * rv::WORD_SIZE);
+            c->cb.symb_emit_mv(dst, temp);
+        }
     }
-    // Save callee-saved registers (fp is included)
-    rv::Register::saved_apply([c, this](rv::Register const& r, int i) {
-        c->cb.emit_sd(r, rv::Register::sp(), -(i + _locc) * rv::WORD_SIZE);
-    });
-    // Set new frame pointer
-    c->cb.emit_mv(rv::Register::fp(), rv::Register::sp());
-    // Save sp
-    // c->cb.emit_sd(rv::Register::sp(), rv::Register::sp(), -(_locc + 13) * rv::WORD_SIZE);
-    c->cb.emit_addi(rv::Register::sp(), rv::Register::sp(), -(_locc + 12) * rv::WORD_SIZE);
+}
+
+// Pops the frame set up by Begin; the code is inserted by Compiler::finish_function
+static void emit_epilogue(rv::Compiler* c) {
+    DCHECK(c->current_frame.has_value()) << "no current frame to leave";
+    c->current_frame->epilogues.push_back(c->cb.position());
 }
 
 void End::emit_code(rv::Compiler* c) const {
-    DCHECK(c->current_frame.has_value()) << "no current frame in End instruction";
-    size_t _locc = c->current_frame->locals_count;
     c->cb.symb_emit_mv(rv::Register::arg(0), c->st.pop());
-    // Restore sp
-    c->cb.emit_mv(rv::Register::sp(), rv::Register::fp());
-    // Restore callee-saved registers (fp is included)
-    rv::Register::saved_apply([c, _locc](rv::Register const& r, int i) {
-        c->cb.emit_ld(r, rv::Register::sp(), -(i + _locc) * rv::WORD_SIZE);
-    });
+    emit_epilogue(c);
     if (c->current_frame->function_name == "main") {
-        c->cb.emit(c->postmain());
+        c->postmain();
     }
     // Return
     c->cb.emit_ret();
 }
 
-void CallClosure::emit_code(rv::Compiler*) const {
-    TODO();
+void CallClosure::emit_code(rv::Compiler* c) const {
+    auto const& node = c->ir->nodes[c->node_index];
+    auto args = pop_operands(c, _argc + 1);
+    auto const closure = args.front();
+    args.erase(args.begin());
+    c->emit_closure_call(closure, args, c->ir->closure_entry(node.uses.back()));
+    c->cb.symb_emit_mv(c->st.alloc(), rv::Register::arg(0));
+}
+
+// Inlined pattern test. `test(value, fail)` branches to `fail` unless the value matches and
+// may use temp1 and temp2; the value is in a register other than those. A test that only
+// decides the next conditional jump branches to its target directly, otherwise the boxed
+// result is pushed.
+template <typename Test>
+static void emit_pattern_test(rv::Compiler* c, Test const& test) {
+    auto const loc = c->st.pop();
+    auto const value = loc.type == SymbolicLocationType::Register ? rv::Register{loc.number} : rv::Register::arg(0);
+    c->cb.symb_emit_mv(value, loc);
+    auto const dest = c->st.alloc();
+    if (c->results_feed_next_only()) {
+        if (auto const* jump = dynamic_cast<ConditionalJump const*>(c->ir->nodes[c->node_index + 1].inst)) {
+            auto const target = c->label_for_ip(jump->target());
+            if (jump->on_zero()) {
+                test(value, target);
+            } else {
+                auto const fail = c->new_label();
+                test(value, fail);
+                c->cb.emit_j(target);
+                c->cb.emit_label(fail);
+            }
+            c->next_fused = true;
+            return;
+        }
+    }
+    auto const fail = c->new_label(), done = c->new_label();
+    auto const dest_reg = c->cb.def_reg(dest, rv::Register::temp1());
+    test(value, fail);
+    c->cb.emit_li(dest_reg, BOX(1));
+    c->cb.emit_j(done);
+    c->cb.emit_label(fail);
+    c->cb.emit_li(dest_reg, BOX(0));
+    c->cb.emit_label(done);
+    c->cb.commit(dest, dest_reg);
+}
+
+// Branches to `fail` unless `value` is boxed (a reference) or, with `boxed` unset, an integer
+static void emit_boxed_check(rv::CodeBuffer& cb, rv::Register value, bool boxed, std::string_view fail) {
+    cb.emit_andi(rv::Register::temp1(), value, 1);
+    cb.emit_branch(boxed ? rv::Op::Bne : rv::Op::Beq, rv::Register::temp1(), rv::Register::zero(), fail);
+}
+
+// Branches to `fail` unless temp1 equals `expected`; clobbers temp1 and temp2
+static void emit_temp_check(rv::CodeBuffer& cb, int64_t expected, std::string_view fail) {
+    auto const temp1 = rv::Register::temp1(), temp2 = rv::Register::temp2();
+    if (fits_imm(-expected)) {
+        cb.emit_addi(temp1, temp1, static_cast<int>(-expected));
+        cb.emit_branch(rv::Op::Bne, temp1, rv::Register::zero(), fail);
+    } else {
+        cb.emit_li(temp2, expected);
+        cb.emit_branch(rv::Op::Bne, temp1, temp2, fail);
+    }
+}
+
+// Branches to `fail` unless `value` is an object with the given tag
+static void emit_tag_check(rv::CodeBuffer& cb, rv::Register value, int64_t tag, std::string_view fail) {
+    emit_boxed_check(cb, value, true, fail);
+    cb.emit_ld(rv::Register::temp1(), value, DATA_HEADER_OFFSET);
+    cb.emit_andi(rv::Register::temp1(), rv::Register::temp1(), 7);
+    emit_temp_check(cb, tag, fail);
+}
+
+// Branches to `fail` unless `value` is an object with the given tag and length; both live in
+// the data header, so one compare checks them
+static void emit_header_check(rv::CodeBuffer& cb, rv::Register value, int64_t tag, size_t length, std::string_view fail) {
+    emit_boxed_check(cb, value, true, fail);
+    cb.emit_ld(rv::Register::temp1(), value, DATA_HEADER_OFFSET);
+    emit_temp_check(cb, static_cast<int64_t>(length << 3) | tag, fail);
 }
 
 void Tag::emit_code(rv::Compiler* c) const {
-    c->cb.symb_emit_li(c->st.alloc(), LtagHash(_tag));
-    c->cb.symb_emit_li(c->st.alloc(), BOX(_size));
-    c->compile_call("Btag", 3);
+    // Sexps keep their tag unboxed
+    int64_t const tag = LtagHash(_tag) >> 1;
+    emit_pattern_test(c, [&](rv::Register value, std::string_view fail) {
+        emit_header_check(c->cb, value, SEXP_TAG, _size, fail);
+        c->cb.emit_ld(rv::Register::temp1(), value, 0);
+        emit_temp_check(c->cb, tag, fail);
+    });
 }
 
-void Array::emit_code(rv::Compiler*) const {
-    TODO();
+void Array::emit_code(rv::Compiler* c) const {
+    emit_pattern_test(c, [&](rv::Register value, std::string_view fail) {
+        emit_header_check(c->cb, value, ARRAY_TAG, _size, fail);
+    });
 }
 
 void Fail::emit_code(rv::Compiler* c) const {
-    c->cb.symb_emit_la(c->st.alloc(), "fname");
-    c->cb.symb_emit_li(c->st.alloc(), BOX(_line));
-    c->cb.symb_emit_li(c->st.alloc(), BOX(_col));
-    c->compile_call("Bmatch_failure", 4);
+    // Does not return, so nothing needs to be saved
+    c->cb.symb_emit_mv(rv::Register::arg(0), c->st.pop());
+    c->cb.emit_la(rv::Register::arg(1), "fname");
+    c->cb.emit_li(rv::Register::arg(2), BOX(_line));
+    c->cb.emit_li(rv::Register::arg(3), BOX(_col));
+    c->cb.emit_call("Bmatch_failure");
 }
 
 void Load::emit_code(rv::Compiler* c) const {
@@ -159,29 +625,15 @@ void Load::emit_code(rv::Compiler* c) const {
         break;
     };
 
-    case Location::Local: {
-        DCHECK_LT(_loc.index, c->current_frame->locals_count) << "local index out of bounds";
-        c->cb.symb_emit_ld(
-            c->st.alloc(), {SymbolicLocationType::Register, rv::Register::fp().regno}, -_loc.index * rv::WORD_SIZE
-        );
-        break;
-    };
-
+    case Location::Local:
     case Location::Arg: {
-        DCHECK_LT(_loc.index, c->current_frame->args_count) << "arg index out of bounds";
-        if (_loc.index < 8) {
-            c->cb.symb_emit_mv(c->st.alloc(), rv::Register::arg(_loc.index));
-        } else {
-            c->cb.symb_emit_ld(
-                c->st.alloc(), {SymbolicLocationType::Register, rv::Register::fp().regno},
-                static_cast<size_t>(_loc.index) - 8
-            );
-        }
+        auto const& node = c->ir->nodes[c->node_index];
+        emit_copy(c, c->st.alloc(), node.defs.front(), c->variable(_loc), *node.var_read);
         break;
     }
 
     case Location::Captured:
-        TODO() << *this;
+        c->cb.symb_emit_ld(c->st.alloc(), c->closure(), (_loc.index + 1) * rv::WORD_SIZE);
         break;
     }
 }
@@ -200,26 +652,47 @@ void Store::emit_code(rv::Compiler* c) const {
         break;
     }
     case Location::Local:
-        c->cb.symb_emit_sd(
-            value, {SymbolicLocationType::Register, rv::Register::fp().regno}, -_loc.index * rv::WORD_SIZE
-        );
-        break;
-    case Location::Arg:
-        if (_loc.index < 8) {
-            c->cb.symb_emit_mv(value, rv::Register::arg(_loc.index));
-        } else {
-            c->cb.symb_emit_sd(
-                value, {SymbolicLocationType::Register, rv::Register::fp().regno}, (_loc.index - 8) * rv::WORD_SIZE
-            );
-        }
+    case Location::Arg: {
+        auto const& node = c->ir->nodes[c->node_index];
+        emit_copy(c, c->variable(_loc), *node.var_write, value, node.uses.front());
         break;
+    }
     case Location::Captured:
-        TODO() << *this;
+        c->cb.symb_emit_sd(value, c->closure(), (_loc.index + 1) * rv::WORD_SIZE);
+        break;
     }
 }
 
-void PatternInst::emit_code(rv::Compiler*) const {
-    TODO();
+void PatternInst::emit_code(rv::Compiler* c) const {
+    if (_type == Pattern::String) {
+        c->compile_call("Bstring_patt", 2);
+        return;
+    }
+    emit_pattern_test(c, [&](rv::Register value, std::string_view fail) {
+        switch (_type) {
+        case Pattern::Boxed:
+            emit_boxed_check(c->cb, value, true, fail);
+            return;
+        case Pattern::Unboxed:
+            emit_boxed_check(c->cb, value, false, fail);
+            return;
+        case Pattern::StringTag:
+            emit_tag_check(c->cb, value, STRING_TAG, fail);
+            return;
+        case Pattern::ArrayTag:
+            emit_tag_check(c->cb, value, ARRAY_TAG, fail);
+            return;
+        case Pattern::SExpTag:
+            emit_tag_check(c->cb, value, SEXP_TAG, fail);
+            return;
+        case Pattern::ClosureTag:
+            emit_tag_check(c->cb, value, CLOSURE_TAG, fail);
+            return;
+        case Pattern::String:
+            break;
+        }
+        LOG(FATAL) << "unexpected pattern";
+    });
 }
 
 void BuiltinLength::emit_code(rv::Compiler* c) const {
@@ -231,29 +704,601 @@ void BuiltinString::emit_code(rv::Compiler* c) const {
 }
 
 void BuiltinArray::emit_code(rv::Compiler* c) const {
-    c->compile_call("RVBarray", _len, BOX(_len));
+    auto const elements = pop_operands(c, _len);
+    emit_allocation(
+        c,
+        ARRAY_TAG,
+        _len,
+        _len,
+        [&](rv::Register object) { emit_fields(c->cb, object, 0, elements); },
+        [&] { c->emit_call("RVBarray", elements, static_cast<int64_t>(BOX(_len))); }
+    );
 }
 
 void Call::emit_code(rv::Compiler* c) const {
-    c->compile_call(_callee, _argc);
+    auto const& node = c->ir->nodes[c->node_index];
+    switch (node.tail_call) {
+    case rv::TailCall::None:
+        c->compile_call(_callee, _argc);
+        return;
+    case rv::TailCall::Loop: {
+        auto const args = pop_operands(c, _argc);
+        std::vector<std::pair<SymbolicLocation, SymbolicLocation>> moves;
+        for (size_t k = 0; k < _argc; ++k) {
+            // Arguments the function never reads have no location
+            auto const arg = node.loop_args[k];
+            if (arg && c->allocation->locs[*arg].type != SymbolicLocationType::Constant) {
+                moves.emplace_back(c->allocation->locs[*arg], args[k]);
+            }
+        }
+        c->cb.symb_emit_parallel_mv(std::move(moves));
+        c->cb.emit_j(c->label_for_ip(c->ir->nodes[node.succs.front()].offset));
+        return;
+    }
+    case rv::TailCall::Jump: {
+        auto const args = pop_operands(c, _argc);
+        for (size_t k = 0; k < _argc; ++k) {
+            c->cb.symb_emit_mv(rv::Register::arg(k), args[k]);
+        }
+        emit_epilogue(c);
+        c->cb.emit_tail(rv::Compiler::callee_label(_callee));
+        return;
+    }
+    }
+}
+
+// Multipliers of one Zba shifted add of a value to itself
+static bool is_shift_add_factor(uint64_t m) {
+    return m == 3 || m == 5 || m == 9;
+}
+
+// Multiplies `a` by `b` with shifts and adds where they do; returns false for other
+// constants. Clobbers a0.
+static bool emit_mul_imm(rv::CodeBuffer& cb, rv::Register dest, rv::Register a, int64_t b) {
+    auto const scratch = rv::Register::arg(0);
+    uint64_t const magnitude = b < 0 ? -static_cast<uint64_t>(b) : b;
+    if (b == 0 || b == 1) {
+        cb.emit_mv(dest, b == 0 ? rv::Register::zero() : a);
+        return true;
+    }
+    if (magnitude == 1) {
+        cb.emit_sub(dest, rv::Register::zero(), a);
+        return true;
+    }
+    if (std::has_single_bit(magnitude)) {
+        cb.emit_slli(dest, a, std::countr_zero(magnitude));
+    } else if (std::has_single_bit(magnitude - 1)) {
+        cb.emit_shift_add(dest, a, std::countr_zero(magnitude - 1), a, scratch);
+    } else if (std::has_single_bit(magnitude + 1)) {
+        cb.emit_slli(scratch, a, std::countr_zero(magnitude + 1));
+        cb.emit_sub(dest, scratch, a);
+    } else if (int const k = std::countr_zero(magnitude); cb.target().zba && is_shift_add_factor(magnitude >> k)) {
+        // 3, 5 or 9 times a power of two
+        cb.emit_shift_add(dest, a, std::countr_zero((magnitude >> k) - 1), a, scratch);
+        cb.emit_slli(dest, dest, k);
+    } else {
+        return false;
+    }
+    if (b < 0) {
+        cb.emit_sub(dest, rv::Register::zero(), dest);
+    }
+    return true;
+}
+
+// Multiplier and shift that turn signed division by `d`, |d| >= 2, into a multiplication
+// by its high half, as in Hacker's Delight, chapter 10
+static std::pair<int64_t, int> division_magic(int64_t d) {
+    uint64_t const two63 = uint64_t{1} << 63;
+    uint64_t const ad = d < 0 ? -static_cast<uint64_t>(d) : d;
+    uint64_t const t = two63 + (static_cast<uint64_t>(d) >> 63);
+    uint64_t const anc = t - 1 - t % ad;
+    int p = 63;
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+    uint64_t delta = 0;
+    do {
+        ++p;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            ++q1;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            ++q2;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    auto const magic = static_cast<int64_t>(q2 + 1);
+    return {d < 0 ? -magic : magic, p - 64};
+}
+
+// Divides `a` by `d`, rounding towards zero like div, without dividing; returns false for
+// a zero divisor. Clobbers temp2 and a0.
+static bool emit_div_imm(rv::CodeBuffer& cb, rv::Register dest, rv::Register a, int64_t d) {
+    auto const temp2 = rv::Register::temp2(), scratch = rv::Register::arg(0);
+    uint64_t const magnitude = d < 0 ? -static_cast<uint64_t>(d) : d;
+    if (magnitude == 0) {
+        return false;
+    }
+    if (magnitude == 1) {
+        cb.emit_mv(dest, a);
+    } else if (std::has_single_bit(magnitude)) {
+        // Negative dividends are biased by the divisor less one, so that the shift rounds
+        // towards zero
+        int const k = std::countr_zero(magnitude);
+        cb.emit_srai(temp2, a, 63);
+        cb.emit_srli(temp2, temp2, 64 - k);
+        cb.emit_add(temp2, temp2, a);
+        cb.emit_srai(dest, temp2, k);
+    } else {
+        auto const [magic, shift] = division_magic(d);
+        cb.emit_li(temp2, magic);
+        cb.emit_mulh(temp2, a, temp2);
+        if (d > 0 && magic < 0) {
+            cb.emit_add(temp2, temp2, a);
+        } else if (d < 0 && magic > 0) {
+            cb.emit_sub(temp2, temp2, a);
+        }
+        if (shift > 0) {
+            cb.emit_srai(temp2, temp2, shift);
+        }
+        // Negative quotients are one short
+        cb.emit_srli(scratch, temp2, 63);
+        cb.emit_add(dest, temp2, scratch);
+        return true;
+    }
+    if (d < 0) {
+        cb.emit_sub(dest, rv::Register::zero(), dest);
+    }
+    return true;
+}
+
+// Remainder of `a` by `d`, with the sign of `a` like rem, without dividing; returns false
+// for a zero divisor. Clobbers temp2, a0 and a1.
+static bool emit_rem_imm(rv::CodeBuffer& cb, rv::Register dest, rv::Register a, int64_t d) {
+    auto const temp2 = rv::Register::temp2(), scratch = rv::Register::arg(0), product = rv::Register::arg(1);
+    // The remainder does not depend on the sign of the divisor
+    uint64_t const magnitude = d < 0 ? -static_cast<uint64_t>(d) : d;
+    if (magnitude == 0) {
+        return false;
+    }
+    if (magnitude == 1) {
+        cb.emit_mv(dest, rv::Register::zero());
+    } else if (std::has_single_bit(magnitude)) {
+        // a less a rounded towards zero to a multiple of the divisor
+        int const k = std::countr_zero(magnitude);
+        cb.emit_srai(temp2, a, 63);
+        cb.emit_srli(temp2, temp2, 64 - k);
+        cb.emit_add(temp2, temp2, a);
+        if (fits_imm(-static_cast<int64_t>(magnitude))) {
+            cb.emit_andi(temp2, temp2, -static_cast<int64_t>(magnitude));
+        } else {
+            cb.emit_srai(temp2, temp2, k);
+            cb.emit_slli(temp2, temp2, k);
+        }
+        cb.emit_sub(dest, a, temp2);
+    } else {
+        auto const divisor = static_cast<int64_t>(magnitude);
+        emit_div_imm(cb, product, a, divisor);
+        if (!emit_mul_imm(cb, product, product, divisor)) {
+            cb.emit_li(scratch, divisor);
+            cb.emit_mul(product, product, scratch);
+        }
+        cb.emit_sub(dest, a, product);
+    }
+    return true;
+}
+
+// Integers are boxed as 2x + 1. Sums and differences of boxed values need one correction,
+// and boxed values compare the same way as the integers they box.
+static void emit_tagged_binop(rv::CodeBuffer& cb, BinopKind op, rv::Register dest, rv::Register a, rv::Register b) {
+    auto const temp1 = rv::Register::temp1();
+    auto const temp2 = rv::Register::temp2();
+    auto const box = [&cb, dest]() {
+        cb.emit_slli(dest, dest, 1);
+        cb.emit_addi(dest, dest, 1);
+    };
+    switch (op) {
+    case BinopKind::Add:
+        cb.emit_add(dest, a, b);
+        cb.emit_addi(dest, dest, -1);
+        break;
+    case BinopKind::Sub:
+        cb.emit_sub(dest, a, b);
+        cb.emit_addi(dest, dest, 1);
+        break;
+    case BinopKind::Mul:
+        // (2x) * y + 1
+        cb.emit_addi(temp1, a, -1);
+        cb.emit_srai(temp2, b, 1);
+        cb.emit_mul(dest, temp1, temp2);
+        cb.emit_addi(dest, dest, 1);
+        break;
+    case BinopKind::Div:
+        // (2x) / (2y) == x / y
+        cb.emit_addi(temp1, a, -1);
+        cb.emit_addi(temp2, b, -1);
+        cb.emit_div(dest, temp1, temp2);
+        box();
+        break;
+    case BinopKind::Rem:
+        // (2x) % (2y) == 2 (x % y)
+        cb.emit_addi(temp1, a, -1);
+        cb.emit_addi(temp2, b, -1);
+        cb.emit_rem(dest, temp1, temp2);
+        cb.emit_addi(dest, dest, 1);
+        break;
+    case BinopKind::LessThan:
+        cb.emit_slt(dest, a, b);
+        box();
+        break;
+    case BinopKind::LessEqual:
+        cb.emit_sle(dest, a, b);
+        box();
+        break;
+    case BinopKind::GreaterThan:
+        cb.emit_sgt(dest, a, b);
+        box();
+        break;
+    case BinopKind::GreaterEqual:
+        cb.emit_sge(dest, a, b);
+        box();
+        break;
+    case BinopKind::Equal:
+        cb.emit_eq(dest, a, b);
+        box();
+        break;
+    case BinopKind::NotEqual:
+        cb.emit_neq(dest, a, b);
+        box();
+        break;
+    case BinopKind::And:
+        // Boxed zero is 1
+        cb.emit_addi(temp1, a, -1);
+        cb.emit_addi(temp2, b, -1);
+        cb.emit_both_nonzero(dest, temp1, temp2);
+        box();
+        break;
+    case BinopKind::Or:
+        // Both operands are odd, so the result is 1 only if both box zero
+        cb.emit_or(dest, a, b);
+        cb.emit_addi(dest, dest, -1);
+        cb.emit_snez(dest, dest);
+        box();
+        break;
+    }
+}
+
+// Binop on unboxed integers. They wrap at 64 bits rather than at the 63 of boxed ones, which
+// only shows once a result no longer fits a boxed integer.
+static void emit_binop(rv::CodeBuffer& cb, BinopKind op, rv::Register dest, rv::Register a, rv::Register b) {
+    switch (op) {
+    case BinopKind::Add:
+        cb.emit_add(dest, a, b);
+        break;
+    case BinopKind::Sub:
+        cb.emit_sub(dest, a, b);
+        break;
+    case BinopKind::Mul:
+        cb.emit_mul(dest, a, b);
+        break;
+    case BinopKind::Div:
+        cb.emit_div(dest, a, b);
+        break;
+    case BinopKind::Rem:
+        cb.emit_rem(dest, a, b);
+        break;
+    case BinopKind::LessThan:
+        cb.emit_slt(dest, a, b);
+        break;
+    case BinopKind::LessEqual:
+        cb.emit_sle(dest, a, b);
+        break;
+    case BinopKind::GreaterThan:
+        cb.emit_sgt(dest, a, b);
+        break;
+    case BinopKind::GreaterEqual:
+        cb.emit_sge(dest, a, b);
+        break;
+    case BinopKind::Equal:
+        cb.emit_eq(dest, a, b);
+        break;
+    case BinopKind::NotEqual:
+        cb.emit_neq(dest, a, b);
+        break;
+    case BinopKind::And:
+        cb.emit_both_nonzero(dest, a, b);
+        break;
+    case BinopKind::Or:
+        cb.emit_or(dest, a, b);
+        cb.emit_snez(dest, dest);
+        break;
+    }
+}
+
+// Binop on an unboxed integer and an unboxed constant; returns false if there is no better
+// sequence than materializing the constant
+static bool emit_binop_imm(rv::CodeBuffer& cb, BinopKind op, rv::Register dest, rv::Register a, int64_t b) {
+    switch (op) {
+    case BinopKind::Add:
+        if (!fits_imm(b)) {
+            return false;
+        }
+        cb.emit_addi(dest, a, b);
+        return true;
+    case BinopKind::Sub:
+        if (!fits_imm(-b)) {
+            return false;
+        }
+        cb.emit_addi(dest, a, -b);
+        return true;
+    case BinopKind::LessThan:
+    case BinopKind::GreaterEqual:
+        if (!fits_imm(b)) {
+            return false;
+        }
+        cb.emit_slti(dest, a, b);
+        if (op == BinopKind::GreaterEqual) {
+            cb.emit_xori(dest, dest, 1);
+        }
+        return true;
+    case BinopKind::LessEqual:
+    case BinopKind::GreaterThan:
+        if (!fits_imm(b + 1)) {
+            return false;
+        }
+        cb.emit_slti(dest, a, b + 1);
+        if (op == BinopKind::GreaterThan) {
+            cb.emit_xori(dest, dest, 1);
+        }
+        return true;
+    case BinopKind::Equal:
+    case BinopKind::NotEqual:
+        if (!fits_imm(b)) {
+            return false;
+        }
+        cb.emit_xori(dest, a, b);
+        if (op == BinopKind::Equal) {
+            cb.emit_seqz(dest, dest);
+        } else {
+            cb.emit_snez(dest, dest);
+        }
+        return true;
+    case BinopKind::And:
+    case BinopKind::Or:
+        // The constant either decides the result or leaves it to `a`
+        if ((op == BinopKind::And) == (b == 0)) {
+            cb.emit_li(dest, int64_t{op == BinopKind::Or});
+            return true;
+        }
+        cb.emit_snez(dest, a);
+        return true;
+    case BinopKind::Mul:
+        return emit_mul_imm(cb, dest, a, b);
+    case BinopKind::Div:
+        return emit_div_imm(cb, dest, a, b);
+    case BinopKind::Rem:
+        return emit_rem_imm(cb, dest, a, b);
+    }
+    return false;
+}
+
+// Branch taken when `op` holds for a and b, with the operands of the branch swapped if needed
+static std::optional<std::tuple<rv::Op, bool>> comparison_branch(BinopKind op) {
+    switch (op) {
+    case BinopKind::LessThan:
+        return std::tuple{rv::Op::Blt, false};
+    case BinopKind::LessEqual:
+        return std::tuple{rv::Op::Bge, true};
+    case BinopKind::GreaterThan:
+        return std::tuple{rv::Op::Blt, true};
+    case BinopKind::GreaterEqual:
+        return std::tuple{rv::Op::Bge, false};
+    case BinopKind::Equal:
+        return std::tuple{rv::Op::Beq, false};
+    case BinopKind::NotEqual:
+        return std::tuple{rv::Op::Bne, false};
+    case BinopKind::Add:
+    case BinopKind::Sub:
+    case BinopKind::Mul:
+    case BinopKind::Div:
+    case BinopKind::Rem:
+    case BinopKind::And:
+    case BinopKind::Or:
+        return std::nullopt;
+    }
+    return std::nullopt;
+}
+
+// Binop with a boxed constant second operand; returns false if there is no better
+// sequence than materializing the constant
+static bool emit_tagged_binop_imm(rv::CodeBuffer& cb, BinopKind op, rv::Register dest, rv::Register a, int64_t b) {
+    auto const temp1 = rv::Register::temp1();
+    auto const temp2 = rv::Register::temp2();
+    auto const box = [&cb, dest]() {
+        cb.emit_slli(dest, dest, 1);
+        cb.emit_addi(dest, dest, 1);
+    };
+    switch (op) {
+    case BinopKind::Add:
+        if (!fits_imm(b - 1)) {
+            return false;
+        }
+        cb.emit_addi(dest, a, b - 1);
+        return true;
+    case BinopKind::Sub:
+        if (!fits_imm(1 - b)) {
+            return false;
+        }
+        cb.emit_addi(dest, a, 1 - b);
+        return true;
+    case BinopKind::Mul:
+        // (2x) * y + 1
+        cb.emit_addi(temp1, a, -1);
+        if (!emit_mul_imm(cb, dest, temp1, b >> 1)) {
+            cb.emit_li(temp2, b >> 1);
+            cb.emit_mul(dest, temp1, temp2);
+        }
+        cb.emit_addi(dest, dest, 1);
+        return true;
+    case BinopKind::Div:
+    case BinopKind::Rem:
+        if (b == 1) {
+            // Division by zero is left to run time
+            return false;
+        }
+        // (2x) / (2y) == x / y and (2x) % (2y) == 2 (x % y)
+        cb.emit_addi(temp1, a, -1);
+        if (op == BinopKind::Div) {
+            emit_div_imm(cb, dest, temp1, b - 1);
+            box();
+        } else {
+            emit_rem_imm(cb, dest, temp1, b - 1);
+            cb.emit_addi(dest, dest, 1);
+        }
+        return true;
+    case BinopKind::LessThan:
+    case BinopKind::GreaterEqual:
+        if (!fits_imm(b)) {
+            return false;
+        }
+        cb.emit_slti(dest, a, b);
+        if (op == BinopKind::GreaterEqual) {
+            cb.emit_xori(dest, dest, 1);
+        }
+        box();
+        return true;
+    case BinopKind::LessEqual:
+    case BinopKind::GreaterThan:
+        if (!fits_imm(b + 1)) {
+            return false;
+        }
+        cb.emit_slti(dest, a, b + 1);
+        if (op == BinopKind::GreaterThan) {
+            cb.emit_xori(dest, dest, 1);
+        }
+        box();
+        return true;
+    case BinopKind::Equal:
+    case BinopKind::NotEqual:
+        if (!fits_imm(b)) {
+            return false;
+        }
+        cb.emit_xori(dest, a, b);
+        if (op == BinopKind::Equal) {
+            cb.emit_seqz(dest, dest);
+        } else {
+            cb.emit_snez(dest, dest);
+        }
+        box();
+        return true;
+    case BinopKind::And:
+    case BinopKind::Or:
+        // Boxed zero is 1: the constant either decides the result or leaves it to `a`
+        if ((op == BinopKind::And) == (b == 1)) {
+            cb.emit_li(dest, BOX(int64_t{op == BinopKind::Or}));
+            return true;
+        }
+        cb.emit_addi(dest, a, -1);
+        cb.emit_snez(dest, dest);
+        box();
+        return true;
+    }
+    return false;
+}
+
+// The operator that gives the same result with the operands swapped
+static std::optional<BinopKind> mirrored_binop(BinopKind op) {
+    switch (op) {
+    case BinopKind::Add:
+    case BinopKind::Mul:
+    case BinopKind::Equal:
+    case BinopKind::NotEqual:
+    case BinopKind::And:
+    case BinopKind::Or:
+        return op;
+    case BinopKind::LessThan:
+        return BinopKind::GreaterThan;
+    case BinopKind::LessEqual:
+        return BinopKind::GreaterEqual;
+    case BinopKind::GreaterThan:
+        return BinopKind::LessThan;
+    case BinopKind::GreaterEqual:
+        return BinopKind::LessEqual;
+    case BinopKind::Sub:
+    case BinopKind::Div:
+    case BinopKind::Rem:
+        return std::nullopt;
+    }
+    return std::nullopt;
 }
 
 void Binop::emit_code(rv::Compiler* c) const {
     auto second_loc = c->st.pop();
     auto first_loc = c->st.pop();
     auto dest_loc = c->st.alloc();
-
-    c->cb.symb_emit_srai(first_loc, first_loc, 1);
-    c->cb.symb_emit_srai(second_loc, second_loc, 1);
-#define EMIT_BINOP(code, symb)                                   \
-    case code: {                                                 \
-        c->cb.symb_emit_##symb(dest_loc, first_loc, second_loc); \
-        break;                                                   \
+    if (dest_loc.type == SymbolicLocationType::Constant) {
+        // Folded at compile time
+        return;
     }
 
-    switch (_op) { BINOPS(EMIT_BINOP); }
-    c->cb.symb_emit_slli(dest_loc, dest_loc, 1);
-    c->cb.symb_emit_addi(dest_loc, dest_loc, 1);
+    auto const& node = c->ir->nodes[c->node_index];
+    // The operands are popped second first
+    auto second = node.uses[0], first = node.uses[1];
+    auto const result = node.defs.front();
+    auto op = _op;
+    // Keep a constant operand second, where it can become an immediate
+    if (first_loc.type == SymbolicLocationType::Constant && second_loc.type != SymbolicLocationType::Constant) {
+        if (auto const mirrored = mirrored_binop(op)) {
+            std::swap(first_loc, second_loc);
+            std::swap(first, second);
+            op = *mirrored;
+        }
+    }
+    // Computes on unboxed integers when both operands are kept so; a constant fits either way, and
+    // in a mixed pair only the odd operand is converted
+    auto const unboxed_operand = [c](SymbolicLocation const& loc, size_t v) {
+        return loc.type == SymbolicLocationType::Constant || c->unboxed(v);
+    };
+    bool const unboxed = (c->unboxed(first) || c->unboxed(second)) && unboxed_operand(first_loc, first) &&
+                         unboxed_operand(second_loc, second);
+    auto const a = operand_reg(c, first_loc, first, unboxed, rv::Register::temp1());
+    // A comparison that only decides the next conditional jump becomes the branch itself
+    if (auto const branch = comparison_branch(op); branch && c->results_feed_next_only()) {
+        if (auto const* jump = dynamic_cast<ConditionalJump const*>(c->ir->nodes[c->node_index + 1].inst)) {
+            auto const b = operand_reg(c, second_loc, second, unboxed, rv::Register::temp2());
+            auto [branch_op, swapped] = *branch;
+            if (jump->on_zero()) {
+                branch_op = rv::inverted_branch(branch_op);
+            }
+            c->cb.emit_branch(branch_op, swapped ? b : a, swapped ? a : b, c->label_for_ip(jump->target()));
+            c->next_fused = true;
+            return;
+        }
+    }
+    auto const dest = c->cb.def_reg(dest_loc, rv::Register::temp1());
+    if (!unboxed) {
+        if (second_loc.type != SymbolicLocationType::Constant ||
+            !emit_tagged_binop_imm(c->cb, op, dest, a, second_loc.value)) {
+            emit_tagged_binop(c->cb, op, dest, a, operand_reg(c, second_loc, second, false, rv::Register::temp2()));
+        }
+        if (c->unboxed(result)) {
+            emit_unbox(c->cb, dest, dest);
+        }
+    } else {
+        if (second_loc.type != SymbolicLocationType::Constant ||
+            !emit_binop_imm(c->cb, op, dest, a, second_loc.value >> 1)) {
+            emit_binop(c->cb, op, dest, a, operand_reg(c, second_loc, second, true, rv::Register::temp2()));
+        }
+        if (!c->unboxed(result)) {
+            emit_box(c->cb, dest, dest);
+        }
+    }
+    c->cb.commit(dest_loc, dest);
 }
 
 }  // namespace lama
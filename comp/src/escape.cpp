@@ -0,0 +1,175 @@
+#include "escape.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <variant>
+#include "instructions.h"
+
+namespace lama::rv {
+
+namespace {
+
+// Words of the object the instruction builds, header included
+std::optional<size_t> object_words(Instruction const& inst) {
+    if (auto const* sexp = dynamic_cast<SExpression const*>(&inst)) {
+        return sexp->size() + 3;
+    }
+    if (auto const* array = dynamic_cast<BuiltinArray const*>(&inst)) {
+        return array->length() + 2;
+    }
+    return std::nullopt;
+}
+
+// Whether the instruction reads its operands without keeping them anywhere
+bool only_examines(Instruction const& inst) {
+    return dynamic_cast<Drop const*>(&inst) || dynamic_cast<Binop const*>(&inst) ||
+           dynamic_cast<ConditionalJump const*>(&inst) || dynamic_cast<Tag const*>(&inst) ||
+           dynamic_cast<Array const*>(&inst) || dynamic_cast<PatternInst const*>(&inst) ||
+           dynamic_cast<BuiltinLength const*>(&inst);
+}
+
+// Whether one of `held` reaches a binary operator, or a function that may apply one to it. Every
+// evaluation of a shared literal yields the same object, so comparing two of them would find them
+// equal where fresh copies differ
+bool compared(FunctionIR const& ir, VregSet const& held) {
+    return std::ranges::any_of(ir.nodes, [&held](auto const& node) {
+        return (dynamic_cast<Binop const*>(node.inst) != nullptr || dynamic_cast<Call const*>(node.inst) != nullptr) &&
+               std::ranges::any_of(node.uses, [&held](size_t v) { return held[v]; });
+    });
+}
+
+}  // namespace
+
+EscapeAnalysis::EscapeAnalysis(std::vector<std::pair<size_t, FunctionIR const*>> const& functions) {
+    for (auto const& [offset, ir] : functions) {
+        auto const* begin = dynamic_cast<Begin const*>(ir->nodes.front().inst);
+        escaping_params_.emplace(offset, std::vector<bool>(begin != nullptr ? begin->argc() : 0, false));
+    }
+    // Parameters start out as not escaping and are marked until nothing changes, so that a
+    // recursive function may pass its own parameters on
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto const& [offset, ir] : functions) {
+            auto& params = escaping_params_.at(offset);
+            for (size_t k = 0; k < params.size(); ++k) {
+                auto const v = ir->variable({.kind = Location::Arg, .index = static_cast<int>(k)});
+                if (!params[k] && v && !aliases(*ir, *v)) {
+                    params[k] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+std::vector<std::pair<size_t, size_t>> EscapeAnalysis::frame_objects(FunctionIR const& ir) const {
+    std::vector<std::pair<size_t, size_t>> objects;
+    size_t total = 0;
+    for (size_t i = 0; i < ir.nodes.size(); ++i) {
+        auto const& node = ir.nodes[i];
+        auto const words = object_words(*node.inst);
+        if (!words || *words > max_object_words || total + *words > max_frame_words) {
+            continue;
+        }
+        DCHECK_EQ(node.defs.size(), 1);
+        auto const held = aliases(ir, node.defs.front());
+        if (!held) {
+            continue;
+        }
+        // The object built here the last time must be dead before this one takes its place
+        bool overwrites_live = false;
+        held->for_each([&](size_t v) { overwrites_live = overwrites_live || node.live_in[v]; });
+        if (overwrites_live) {
+            continue;
+        }
+        objects.emplace_back(i, *words);
+        total += *words;
+    }
+    return objects;
+}
+
+std::vector<size_t> EscapeAnalysis::shared_strings(FunctionIR const& ir) const {
+    std::vector<size_t> nodes;
+    for (size_t i = 0; i < ir.nodes.size(); ++i) {
+        auto const& node = ir.nodes[i];
+        if (dynamic_cast<String const*>(node.inst) == nullptr) {
+            continue;
+        }
+        auto const held = aliases(ir, node.defs.front());
+        if (held && !compared(ir, *held)) {
+            nodes.push_back(i);
+        }
+    }
+    return nodes;
+}
+
+std::optional<VregSet> EscapeAnalysis::aliases(FunctionIR const& ir, size_t vreg) const {
+    VregSet held(ir.vregs_count);
+    held.set(vreg);
+    auto const holds = [&held](size_t v) { return held[v]; };
+    for (bool changed = true; changed;) {
+        changed = false;
+        auto const add = [&](size_t v) {
+            if (!held[v]) {
+                held.set(v);
+                changed = true;
+            }
+        };
+        for (auto const& node : ir.nodes) {
+            if (std::ranges::none_of(node.uses, holds) && !(node.var_read && held[*node.var_read]) &&
+                std::ranges::none_of(node.closure_reads, holds)) {
+                continue;
+            }
+            auto const& inst = *node.inst;
+            if (dynamic_cast<Load const*>(&inst) || !node.info.copies.empty()) {
+                std::ranges::for_each(node.defs, add);
+            } else if (dynamic_cast<Store const*>(&inst)) {
+                // Globals and captured variables outlive the call
+                if (!node.var_write) {
+                    return std::nullopt;
+                }
+                add(*node.var_write);
+            } else if (dynamic_cast<Elem const*>(&inst)) {
+                // The operands are the index, then the aggregate
+                if (held[node.uses.front()]) {
+                    return std::nullopt;
+                }
+            } else if (dynamic_cast<Call const*>(&inst)) {
+                auto const* callee = std::get_if<size_t>(&*node.info.callee);
+                auto const params = callee != nullptr ? escaping_params_.find(*callee) : escaping_params_.end();
+                // A tail call leaves the frame before the callee runs
+                if (params == escaping_params_.end() || node.tail_call != TailCall::None) {
+                    return std::nullopt;
+                }
+                // The arguments are popped last first
+                for (size_t k = 0; k < node.uses.size(); ++k) {
+                    size_t const param = node.uses.size() - 1 - k;
+                    if (held[node.uses[k]] && (param >= params->second.size() || params->second[param])) {
+                        return std::nullopt;
+                    }
+                }
+            } else if (!only_examines(inst)) {
+                return std::nullopt;
+            }
+        }
+    }
+    return held;
+}
+
+void place_frame_objects(
+    Allocation& allocation, FunctionIR const& ir, std::vector<std::pair<size_t, size_t>> const& objects
+) {
+    for (auto const& [node, words] : objects) {
+        // Slots grow downwards, so the header takes the last one
+        FrameObject object{.header_slot = allocation.slots_count + words};
+        // A sexp keeps its tag unboxed in the first word of the contents
+        size_t const first_value = dynamic_cast<SExpression const*>(ir.nodes[node].inst) != nullptr ? 3 : 2;
+        for (size_t k = first_value; k < words; ++k) {
+            object.value_slots.push_back(object.header_slot - k);
+        }
+        allocation.slots_count += words;
+        allocation.frame_objects.emplace(node, std::move(object));
+    }
+}
+
+}  // namespace lama::rv
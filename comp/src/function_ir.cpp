@@ -0,0 +1,544 @@
+#include "function_ir.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <format>
+#include <ranges>
+#include <unordered_map>
+#include <variant>
+#include "instruction.h"
+
+namespace lama::rv {
+
+namespace {
+
+class UnionFind {
+public:
+    size_t make() {
+        parent_.push_back(parent_.size());
+        return parent_.size() - 1;
+    }
+
+    size_t find(size_t x) {
+        while (parent_[x] != x) {
+            x = parent_[x] = parent_[parent_[x]];
+        }
+        return x;
+    }
+
+    void unite(size_t a, size_t b) {
+        parent_[find(a)] = find(b);
+    }
+
+    size_t size() const {
+        return parent_.size();
+    }
+
+private:
+    std::vector<size_t> parent_;
+};
+
+bool is_allocatable(LocationEntry const& entry) {
+    return entry.kind == Location::Local || entry.kind == Location::Arg;
+}
+
+}  // namespace
+
+std::optional<size_t> FunctionIR::variable(LocationEntry entry) const {
+    for (size_t i = 0; i < variables.size(); ++i) {
+        if (variables[i].kind == entry.kind && variables[i].index == entry.index) {
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
+FunctionIR FunctionIR::build(std::vector<std::pair<size_t, Instruction const*>> const& body) {
+    CHECK(!body.empty());
+    DCHECK(body.front().second->is_function_entry());
+
+    std::unordered_map<size_t, size_t> index_of;
+    for (size_t i = 0; i < body.size(); ++i) {
+        index_of.emplace(body[i].first, i);
+    }
+
+    FunctionIR ir;
+    auto const variable_id = [&ir](LocationEntry const& entry) -> std::optional<size_t> {
+        if (!is_allocatable(entry)) {
+            return std::nullopt;
+        }
+        if (auto id = ir.variable(entry)) {
+            return id;
+        }
+        ir.variables.push_back(entry);
+        return ir.variables.size() - 1;
+    };
+    auto const closure_id = [&ir]() {
+        if (!ir.closure) {
+            ir.variables.push_back({.kind = Location::Captured, .index = -1});
+            ir.closure = ir.variables.size() - 1;
+        }
+        return *ir.closure;
+    };
+
+    // Instructions that only rearrange the stack push the values they copy instead of new
+    // ones. Such aliases must not reach a jump target: merging the stacks there could give
+    // values live at the same time one vreg. The instructions that made them are then
+    // compiled as moves, and the symbolic execution starts over.
+    std::vector<bool> is_target(body.size(), false);
+    for (auto const& [offset, inst] : body) {
+        auto const target = inst->info().jump_target;
+        if (target && index_of.contains(*target)) {
+            is_target[index_of.at(*target)] = true;
+        }
+    }
+    std::vector<bool> moves(body.size(), false);
+    UnionFind values;
+    std::vector<std::optional<IrNode>> visited;
+    auto const execute = [&]() {
+        values = UnionFind{};
+        visited.assign(body.size(), std::nullopt);
+        // Instruction that placed each stack entry by renaming, if any
+        std::vector<std::vector<std::optional<size_t>>> entry_renamers(body.size());
+        std::vector<size_t> worklist{0};
+        visited[0] = IrNode{.offset = body[0].first, .inst = body[0].second, .info = body[0].second->info()};
+        bool restart = false;
+        while (!worklist.empty()) {
+            size_t const i = worklist.back();
+            worklist.pop_back();
+            auto& node = *visited[i];
+            auto const& info = node.info;
+
+            auto stack = node.entry_stack;
+            auto renamers = entry_renamers[i];
+            CHECK_GE(stack.size(), info.pops + info.peeks) << std::format("stack underflow at {:#x}", node.offset);
+            node.renamed = !info.copies.empty() && !moves[i];
+            std::vector<size_t> copied;
+            for (auto depth : info.copies) {
+                copied.push_back(stack[stack.size() - 1 - depth]);
+            }
+            if (!node.renamed) {
+                for (size_t k = 0; k < info.peeks; ++k) {
+                    node.uses.push_back(stack[stack.size() - 1 - k]);
+                }
+            }
+            for (size_t k = 0; k < info.pops; ++k) {
+                if (!node.renamed) {
+                    node.uses.push_back(stack.back());
+                }
+                stack.pop_back();
+                renamers.pop_back();
+            }
+            for (size_t k = 0; k < info.pushes; ++k) {
+                if (node.renamed) {
+                    stack.push_back(copied[k]);
+                    renamers.push_back(i);
+                } else {
+                    node.defs.push_back(values.make());
+                    stack.push_back(node.defs.back());
+                    renamers.push_back(std::nullopt);
+                }
+            }
+            if (info.reads) {
+                node.var_read = variable_id(*info.reads);
+            }
+            if (info.writes) {
+                node.var_write = variable_id(*info.writes);
+            }
+            // Captured variables are reached through the closure
+            auto const closure_read = [&node](std::optional<size_t> v) {
+                if (v && std::ranges::find(node.closure_reads, *v) == node.closure_reads.end()) {
+                    node.closure_reads.push_back(*v);
+                }
+            };
+            for (auto const& entry : {info.reads, info.writes}) {
+                if (entry && entry->kind == Location::Captured) {
+                    closure_read(closure_id());
+                }
+            }
+            for (auto const& entry : info.captures) {
+                closure_read(entry.kind == Location::Captured ? closure_id() : variable_id(entry));
+            }
+
+            std::vector<size_t> succs;
+            if (!node.inst->is_terminator()) {
+                CHECK_LT(i + 1, body.size()) << std::format("control falls off the function at {:#x}", node.offset);
+                succs.push_back(i + 1);
+            }
+            if (info.jump_target) {
+                auto target = index_of.find(*info.jump_target);
+                CHECK(target != index_of.end()) << std::format("jump out of the function at {:#x}", node.offset);
+                succs.push_back(target->second);
+            }
+            for (auto succ : succs) {
+                if (is_target[succ]) {
+                    for (auto const& renamer : renamers) {
+                        if (renamer) {
+                            moves[*renamer] = true;
+                            restart = true;
+                        }
+                    }
+                }
+                node.succs.push_back(succ);
+                auto& next = visited[succ];
+                if (!next) {
+                    next = IrNode{
+                        .offset = body[succ].first,
+                        .inst = body[succ].second,
+                        .info = body[succ].second->info(),
+                        .entry_stack = stack,
+                    };
+                    entry_renamers[succ] = renamers;
+                    worklist.push_back(succ);
+                    continue;
+                }
+                CHECK_EQ(next->entry_stack.size(), stack.size())
+                    << std::format("stack height mismatch at {:#x}", next->offset);
+                for (size_t k = 0; k < stack.size(); ++k) {
+                    values.unite(next->entry_stack[k], stack[k]);
+                }
+            }
+        }
+        return !restart;
+    };
+    // Every restart turns at least one more instruction into moves
+    while (!execute()) {
+        ir.variables.clear();
+        ir.closure.reset();
+    }
+
+    // Merged values become one vreg
+    std::vector<size_t> class_vreg(values.size(), SIZE_MAX);
+    ir.vregs_count = ir.variables.size();
+    for (size_t v = 0; v < values.size(); ++v) {
+        auto& vreg = class_vreg[values.find(v)];
+        if (vreg == SIZE_MAX) {
+            vreg = ir.vregs_count++;
+        }
+    }
+    auto const vreg_of = [&](size_t value) { return class_vreg[values.find(value)]; };
+
+    // Reachable instructions keep their bytecode order
+    std::vector<size_t> node_index(body.size(), SIZE_MAX);
+    for (size_t i = 0; i < body.size(); ++i) {
+        if (visited[i]) {
+            node_index[i] = ir.nodes.size();
+            ir.nodes.push_back(std::move(*visited[i]));
+        }
+    }
+    for (auto& node : ir.nodes) {
+        for (auto* list : {&node.entry_stack, &node.uses, &node.defs}) {
+            for (auto& value : *list) {
+                value = vreg_of(value);
+            }
+        }
+        for (auto& succ : node.succs) {
+            succ = node_index[succ];
+        }
+    }
+    for (size_t i = 0; i < ir.nodes.size(); ++i) {
+        for (auto succ : ir.nodes[i].succs) {
+            ir.nodes[succ].preds.push_back(i);
+        }
+    }
+
+    ir.mark_tail_calls();
+    ir.build_blocks();
+    ir.compute_dominators();
+    ir.compute_constants();
+    ir.compute_closure_entries();
+    ir.compute_loop_depth();
+    ir.compute_liveness();
+    return ir;
+}
+
+// Whether control goes from the node straight to the function exit, through instructions
+// without any effect, so that the value it pushes is the one returned
+bool FunctionIR::returns_result_of(size_t index) const {
+    for (size_t steps = 0; steps < nodes.size(); ++steps) {
+        auto const& node = nodes[index];
+        if (node.succs.size() != 1) {
+            return false;
+        }
+        auto const& next = nodes[node.succs.front()];
+        if (next.inst->is_function_exit()) {
+            return true;
+        }
+        auto const& info = next.info;
+        if (info.pops != 0 || info.pushes != 0 || info.peeks != 0 || info.reads || info.writes || info.callee) {
+            return false;
+        }
+        index = node.succs.front();
+    }
+    return false;
+}
+
+// Calls whose result is returned right away need no frame of their own. A call of the
+// function itself with nothing else on the stack becomes a back edge to the first node
+// after BEGIN. Other calls become jumps if their arguments fit in registers, except in the
+// program entry, whose exit does more than return.
+void FunctionIR::mark_tail_calls() {
+    auto const& entry = nodes.front();
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        auto& node = nodes[i];
+        if (!node.inst->is_call() || !returns_result_of(i)) {
+            continue;
+        }
+        auto const* offset = std::get_if<size_t>(&*node.info.callee);
+        size_t const argc = node.info.pops;
+        if (offset && *offset == entry.offset && node.entry_stack.size() == argc && entry.succs.size() == 1) {
+            node.tail_call = TailCall::Loop;
+            for (size_t k = 0; k < argc; ++k) {
+                node.loop_args.push_back(variable({.kind = Location::Arg, .index = static_cast<int>(k)}));
+            }
+        } else if (argc <= 8 && !entry.inst->is_program_entry()) {
+            node.tail_call = TailCall::Jump;
+        } else {
+            continue;
+        }
+        node.defs.clear();
+        for (auto succ : node.succs) {
+            std::erase(nodes[succ].preds, i);
+        }
+        node.succs.clear();
+        if (node.tail_call == TailCall::Loop) {
+            node.succs.push_back(entry.succs.front());
+            nodes[entry.succs.front()].preds.push_back(i);
+        }
+    }
+}
+
+// A node starts a block unless it is the only successor of the node before it, and that node
+// is its only predecessor
+void FunctionIR::build_blocks() {
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        auto const& node = nodes[i];
+        bool const continues = i != 0 && node.preds.size() == 1 && node.preds.front() == i - 1 &&
+                               nodes[i - 1].succs.size() == 1;
+        if (!continues) {
+            blocks.push_back(BasicBlock{.first = i, .last = i, .entry_height = node.entry_stack.size()});
+        }
+        blocks.back().last = i;
+        nodes[i].block = blocks.size() - 1;
+    }
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        for (auto succ : nodes[blocks[b].last].succs) {
+            blocks[b].succs.push_back(nodes[succ].block);
+            blocks[nodes[succ].block].preds.push_back(b);
+        }
+    }
+}
+
+// Cooper, Harvey and Kennedy's iterative algorithm over the reverse postorder
+void FunctionIR::compute_dominators() {
+    std::vector<bool> seen(blocks.size(), false);
+    std::vector<std::pair<size_t, size_t>> stack{{0, 0}};  // block, next successor to visit
+    seen[0] = true;
+    while (!stack.empty()) {
+        auto& [b, next] = stack.back();
+        if (next < blocks[b].succs.size()) {
+            auto const succ = blocks[b].succs[next++];
+            if (!seen[succ]) {
+                seen[succ] = true;
+                stack.emplace_back(succ, 0);
+            }
+            continue;
+        }
+        block_order.push_back(b);
+        stack.pop_back();
+    }
+    std::ranges::reverse(block_order);
+
+    std::vector<size_t> order_index(blocks.size(), SIZE_MAX);
+    for (size_t k = 0; k < block_order.size(); ++k) {
+        order_index[block_order[k]] = k;
+    }
+    auto const intersect = [&](size_t a, size_t b) {
+        while (a != b) {
+            while (order_index[a] > order_index[b]) {
+                a = *blocks[a].idom;
+            }
+            while (order_index[b] > order_index[a]) {
+                b = *blocks[b].idom;
+            }
+        }
+        return a;
+    };
+    // The entry is provisionally its own dominator, so that the chains above end
+    blocks[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto b : block_order | std::views::drop(1)) {
+            std::optional<size_t> idom;
+            for (auto pred : blocks[b].preds) {
+                if (blocks[pred].idom) {
+                    idom = idom ? intersect(*idom, pred) : pred;
+                }
+            }
+            if (idom != blocks[b].idom) {
+                blocks[b].idom = idom;
+                changed = true;
+            }
+        }
+    }
+    blocks[0].idom.reset();
+}
+
+// A stack vreg is constant if all its definitions agree on a value. Values only ever become
+// known, so iterating until nothing changes terminates.
+void FunctionIR::compute_constants() {
+    size_t const stack_vregs = vregs_count - variables.size();
+    constants.assign(stack_vregs, std::nullopt);
+    bool changed = true;
+    while (changed) {
+        std::vector<std::optional<int64_t>> next(stack_vregs);
+        std::vector<bool> conflict(stack_vregs, false);
+        for (auto const& node : nodes) {
+            if (node.defs.empty()) {
+                continue;
+            }
+            std::vector<std::optional<int64_t>> operands;
+            for (auto v : node.uses) {
+                operands.push_back(constant(v));
+            }
+            auto const value = node.defs.size() == 1 ? node.inst->constant_result(operands) : std::nullopt;
+            for (auto v : node.defs) {
+                size_t const k = v - variables.size();
+                if (!value || (next[k] && next[k] != value)) {
+                    conflict[k] = true;
+                }
+                next[k] = value;
+            }
+        }
+        for (size_t k = 0; k < stack_vregs; ++k) {
+            if (conflict[k]) {
+                next[k] = std::nullopt;
+            }
+        }
+        changed = next != constants;
+        constants = std::move(next);
+    }
+}
+
+// Like the constants, except that variables have definitions too: the stores to them. The
+// arguments and the closure variable are set by the caller and may hold any closure. A vreg
+// only goes from no known definition to a known function to conflicting ones, so iterating
+// until nothing changes terminates.
+void FunctionIR::compute_closure_entries() {
+    closure_entries.assign(vregs_count, std::nullopt);
+    std::vector<bool> conflict(vregs_count, false);
+    for (size_t v = 0; v < variables.size(); ++v) {
+        conflict[v] = variables[v].kind != Location::Local;
+    }
+    bool changed = true;
+    auto const define = [&](size_t v, std::optional<size_t> entry) {
+        if (conflict[v]) {
+            return;
+        }
+        if (!entry || (closure_entries[v] && closure_entries[v] != entry)) {
+            conflict[v] = true;
+            changed = true;
+        } else if (!closure_entries[v]) {
+            closure_entries[v] = entry;
+            changed = true;
+        }
+    };
+    auto const copy = [&](size_t v, size_t from) {
+        if (conflict[from] || closure_entries[from]) {
+            define(v, conflict[from] ? std::nullopt : closure_entries[from]);
+        }
+    };
+    while (changed) {
+        changed = false;
+        for (auto const& node : nodes) {
+            if (node.info.closure_entry) {
+                define(node.defs.front(), node.info.closure_entry);
+            } else if (node.var_read) {
+                copy(node.defs.front(), *node.var_read);
+            } else if (node.var_write) {
+                copy(*node.var_write, node.uses.front());
+            } else if (!node.info.copies.empty()) {
+                // Compiled as moves unless renamed, when there are no definitions
+                for (size_t k = 0; k < node.defs.size(); ++k) {
+                    copy(node.defs[k], node.entry_stack[node.entry_stack.size() - 1 - node.info.copies[k]]);
+                }
+            } else {
+                for (auto v : node.defs) {
+                    define(v, std::nullopt);
+                }
+            }
+        }
+    }
+    for (size_t v = 0; v < vregs_count; ++v) {
+        if (conflict[v]) {
+            closure_entries[v].reset();
+        }
+    }
+}
+
+// An edge to a block that dominates its source closes a natural loop: the header and every
+// block that reaches the source without passing through the header
+void FunctionIR::compute_loop_depth() {
+    for (size_t header = 0; header < blocks.size(); ++header) {
+        std::vector<bool> in_loop(blocks.size(), false);
+        std::vector<size_t> worklist;
+        for (auto pred : blocks[header].preds) {
+            if (dominates(header, pred) && !in_loop[pred]) {
+                in_loop[pred] = true;
+                worklist.push_back(pred);
+            }
+        }
+        if (worklist.empty()) {
+            continue;
+        }
+        in_loop[header] = true;
+        while (!worklist.empty()) {
+            auto const b = worklist.back();
+            worklist.pop_back();
+            for (auto pred : blocks[b].preds) {
+                // Blocks left unreachable by tail calls belong to no loop
+                if (!in_loop[pred] && blocks[pred].idom) {
+                    in_loop[pred] = true;
+                    worklist.push_back(pred);
+                }
+            }
+        }
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            if (in_loop[b]) {
+                ++blocks[b].loop_depth;
+            }
+        }
+    }
+    for (auto& node : nodes) {
+        node.loop_depth = blocks[node.block].loop_depth;
+    }
+}
+
+void FunctionIR::compute_liveness() {
+    for (auto& node : nodes) {
+        node.live_in = VregSet(vregs_count);
+        node.live_out = VregSet(vregs_count);
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = nodes.size(); i-- > 0;) {
+            auto& node = nodes[i];
+            VregSet out(vregs_count);
+            for (auto succ : node.succs) {
+                out |= nodes[succ].live_in;
+            }
+            VregSet in = out;
+            for_each_def(node, [&in](size_t vreg) { in.reset(vreg); });
+            for_each_use(node, [&in](size_t vreg) { in.set(vreg); });
+            if (in != node.live_in || out != node.live_out) {
+                node.live_in = std::move(in);
+                node.live_out = std::move(out);
+                changed = true;
+            }
+        }
+    }
+}
+
+}  // namespace lama::rv
@@ -0,0 +1,192 @@
+#include <glog/logging.h>
+#include <cstdint>
+#include "instructions.h"
+#include "opcode.h"
+
+namespace lama {
+
+InstInfo Const::info() const {
+    return {.pushes = 1};
+}
+
+std::optional<int64_t> Const::constant_result(std::vector<std::optional<int64_t>> const&) const {
+    return _value;
+}
+
+InstInfo String::info() const {
+    return {.pushes = 1, .callee = "RVBstring"};
+}
+
+InstInfo SExpression::info() const {
+    return {.pops = _size, .pushes = 1, .callee = "RVBsexp"};
+}
+
+InstInfo StoreStack::info() const {
+    return {.pops = 2, .pushes = 1};
+}
+
+InstInfo StoreArray::info() const {
+    return {.pops = 3, .pushes = 1, .callee = "Bsta"};
+}
+
+InstInfo Jump::info() const {
+    return {.jump_target = _target};
+}
+
+InstInfo ConditionalJump::info() const {
+    return {.pops = 1, .jump_target = _target};
+}
+
+InstInfo Return::info() const {
+    return {.pops = 1};
+}
+
+InstInfo Drop::info() const {
+    return {.pops = 1};
+}
+
+InstInfo Duplicate::info() const {
+    return {.pushes = 1, .peeks = 1, .copies = {0}};
+}
+
+std::optional<int64_t> Duplicate::constant_result(std::vector<std::optional<int64_t>> const& operands) const {
+    return operands.front();
+}
+
+InstInfo Swap::info() const {
+    return {.pops = 2, .pushes = 2, .copies = {0, 1}};
+}
+
+InstInfo Elem::info() const {
+    return {.pops = 2, .pushes = 1, .callee = "Belem"};
+}
+
+InstInfo Closure::info() const {
+    return {.pushes = 1, .captures = _entries, .closure_entry = _offset, .callee = "RVBclosure"};
+}
+
+InstInfo CBegin::info() const {
+    return {};
+}
+
+InstInfo Begin::info() const {
+    return {};
+}
+
+InstInfo End::info() const {
+    return {.pops = 1};
+}
+
+InstInfo CallClosure::info() const {
+    return {.pops = _argc + 1, .pushes = 1, .callee = rv::ClosureCallee{}};
+}
+
+InstInfo Call::info() const {
+    return {.pops = _argc, .pushes = 1, .callee = _callee};
+}
+
+InstInfo Tag::info() const {
+    return {.pops = 1, .pushes = 1};
+}
+
+InstInfo Array::info() const {
+    return {.pops = 1, .pushes = 1};
+}
+
+InstInfo Fail::info() const {
+    return {.pops = 1, .callee = "Bmatch_failure"};
+}
+
+InstInfo Line::info() const {
+    return {};
+}
+
+InstInfo Binop::info() const {
+    return {.pops = 2, .pushes = 1};
+}
+
+// Mirrors the lowering of Binop on boxed values, including wraparound
+std::optional<int64_t> Binop::constant_result(std::vector<std::optional<int64_t>> const& operands) const {
+    if (!operands[0] || !operands[1]) {
+        return std::nullopt;
+    }
+    uint64_t const a = *operands[1], b = *operands[0];
+    int64_t const x = static_cast<int64_t>(a) >> 1, y = static_cast<int64_t>(b) >> 1;
+    auto const box = [](bool value) -> int64_t { return BOX(int64_t{value}); };
+    switch (_op) {
+    case BinopKind::Add:
+        return a + b - 1;
+    case BinopKind::Sub:
+        return a - b + 1;
+    case BinopKind::Mul:
+        return (a - 1) * static_cast<uint64_t>(y) + 1;
+    case BinopKind::Div:
+    case BinopKind::Rem: {
+        // Leave division by zero and overflow to run time
+        int64_t const num = a - 1, den = b - 1;
+        if (den == 0 || (num == INT64_MIN && den == -1)) {
+            return std::nullopt;
+        }
+        return _op == BinopKind::Div ? (num / den) * 2 + 1 : num % den + 1;
+    }
+    case BinopKind::LessThan:
+        return box(x < y);
+    case BinopKind::LessEqual:
+        return box(x <= y);
+    case BinopKind::GreaterThan:
+        return box(x > y);
+    case BinopKind::GreaterEqual:
+        return box(x >= y);
+    case BinopKind::Equal:
+        return box(x == y);
+    case BinopKind::NotEqual:
+        return box(x != y);
+    case BinopKind::And:
+        return box(x != 0 && y != 0);
+    case BinopKind::Or:
+        return box(x != 0 || y != 0);
+    }
+    return std::nullopt;
+}
+
+InstInfo Load::info() const {
+    return {.pushes = 1, .reads = _loc};
+}
+
+InstInfo LoadArray::info() const {
+    return {.pushes = 1};
+}
+
+InstInfo Store::info() const {
+    return {.peeks = 1, .writes = _loc};
+}
+
+InstInfo PatternInst::info() const {
+    // Only string patterns call the runtime, the others are tested inline
+    if (_type == Pattern::String) {
+        return {.pops = 2, .pushes = 1, .callee = "Bstring_patt"};
+    }
+    return {.pops = 1, .pushes = 1};
+}
+
+InstInfo BuiltinRead::info() const {
+    return {.pushes = 1, .callee = "Lread"};
+}
+
+InstInfo BuiltinWrite::info() const {
+    return {.pops = 1, .pushes = 1, .callee = "Lwrite"};
+}
+
+InstInfo BuiltinLength::info() const {
+    return {.pops = 1, .pushes = 1, .callee = "Llength"};
+}
+
+InstInfo BuiltinString::info() const {
+    return {.pops = 1, .pushes = 1, .callee = "RVLstring"};
+}
+
+InstInfo BuiltinArray::info() const {
+    return {.pops = _len, .pushes = 1, .callee = "RVBarray"};
+}
+
+}  // namespace lama
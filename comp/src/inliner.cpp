@@ -0,0 +1,190 @@
+#include "inliner.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <ranges>
+#include <variant>
+#include "function_ir.h"
+#include "instructions.h"
+
+namespace lama {
+
+namespace {
+
+// Where the variables and jump targets of a callee end up in the copy
+struct Renaming {
+    // Caller local that holds the first argument; the callee locals follow the arguments
+    int first_local;
+    size_t argc;
+    std::unordered_map<size_t, size_t> const& offsets;
+
+    LocationEntry variable(LocationEntry entry) const {
+        switch (entry.kind) {
+        case Location::Arg:
+            return {.kind = Location::Local, .index = first_local + entry.index};
+        case Location::Local:
+            return {.kind = Location::Local, .index = first_local + static_cast<int>(argc) + entry.index};
+        case Location::Global:
+        case Location::Captured:
+            return entry;
+        }
+        LOG(FATAL) << "unknown location";
+        return entry;
+    }
+
+    int target(size_t offset) const {
+        return static_cast<int>(offsets.at(offset));
+    }
+};
+
+template <typename T>
+std::unique_ptr<Instruction> copy(T const& inst, Renaming const&) {
+    return std::make_unique<T>(inst);
+}
+
+std::unique_ptr<Instruction> copy(Load const& inst, Renaming const& renaming) {
+    return std::make_unique<Load>(renaming.variable(inst.location()));
+}
+
+std::unique_ptr<Instruction> copy(Store const& inst, Renaming const& renaming) {
+    return std::make_unique<Store>(renaming.variable(inst.location()));
+}
+
+std::unique_ptr<Instruction> copy(Jump const& inst, Renaming const& renaming) {
+    return std::make_unique<Jump>(renaming.target(inst.target()));
+}
+
+std::unique_ptr<Instruction> copy(ConditionalJump const& inst, Renaming const& renaming) {
+    return std::make_unique<ConditionalJump>(renaming.target(inst.target()), inst.on_zero());
+}
+
+std::unique_ptr<Instruction> copy_instruction(Instruction const& inst, Renaming const& renaming) {
+#define COPY_IF(T)                                         \
+    if (auto const* typed = dynamic_cast<T const*>(&inst)) { \
+        return copy(*typed, renaming);                     \
+    }
+    INSTRUCTIONS(COPY_IF)
+#undef COPY_IF
+    LOG(FATAL) << "cannot copy " << inst;
+    return nullptr;
+}
+
+// Whether the instruction means the same once moved into another function
+bool is_movable(Instruction const& inst, size_t own_offset, FunctionBody const& body) {
+    if (dynamic_cast<Return const*>(&inst) || dynamic_cast<Closure const*>(&inst) ||
+        dynamic_cast<LoadArray const*>(&inst)) {
+        return false;
+    }
+    auto const info = inst.info();
+    for (auto const& entry : {info.reads, info.writes}) {
+        if (entry && entry->kind == Location::Captured) {
+            return false;
+        }
+    }
+    if (info.callee && std::holds_alternative<size_t>(*info.callee) && std::get<size_t>(*info.callee) == own_offset) {
+        return false;
+    }
+    if (info.jump_target) {
+        return std::ranges::any_of(body, [&](auto const& entry) { return entry.first == *info.jump_target; });
+    }
+    return true;
+}
+
+bool is_candidate(FunctionBody const& body) {
+    auto const* begin = dynamic_cast<Begin const*>(body.front().second);
+    if (begin == nullptr || begin->is_program_entry()) {
+        return false;
+    }
+    auto const size = std::ranges::count_if(body | std::views::drop(1), [](auto const& entry) {
+        return dynamic_cast<Line const*>(entry.second) == nullptr;
+    });
+    if (static_cast<size_t>(size) > Inliner::max_callee_size) {
+        return false;
+    }
+    size_t const own_offset = body.front().first;
+    for (auto const& [offset, inst] : body | std::views::drop(1)) {
+        if (inst->is_function_entry() || !is_movable(*inst, own_offset, body)) {
+            return false;
+        }
+    }
+    // Every END must leave just the result, which the copy keeps on the caller's stack
+    auto const ir = rv::FunctionIR::build(body);
+    return std::ranges::all_of(ir.nodes, [](rv::IrNode const& node) {
+        return !node.inst->is_function_exit() || node.entry_stack.size() == 1;
+    });
+}
+
+}  // namespace
+
+Inliner::Inliner(std::vector<FunctionBody> const& functions, size_t end_offset)
+    : next_offset_(end_offset) {
+    for (auto const& body : functions) {
+        if (is_candidate(body)) {
+            candidates_.emplace(body.front().first, &body);
+        }
+    }
+}
+
+FunctionBody Inliner::expand(FunctionBody const& body) {
+    auto const* caller = dynamic_cast<Begin const*>(body.front().second);
+    if (caller == nullptr) {
+        return body;
+    }
+    FunctionBody result;
+    auto next_local = static_cast<int>(caller->locc());
+    size_t growth = 0;
+    for (size_t i = 0; i < body.size(); ++i) {
+        auto const [offset, inst] = body[i];
+        auto const info = inst->info();
+        auto const* target = inst->is_call() && info.callee ? std::get_if<size_t>(&*info.callee) : nullptr;
+        auto const callee = target != nullptr && *target != body.front().first ? candidates_.find(*target)
+                                                                                 : candidates_.end();
+        // The copy falls through to the instruction after the call
+        if (callee == candidates_.end() || i + 1 == body.size()) {
+            result.push_back(body[i]);
+            continue;
+        }
+        auto const& callee_body = *callee->second;
+        auto const* begin = static_cast<Begin const*>(callee_body.front().second);
+        size_t const argc = begin->argc();
+        size_t const size = 2 * argc + callee_body.size() - 1;
+        if (argc != info.pops || growth + size > max_growth) {
+            result.push_back(body[i]);
+            continue;
+        }
+        growth += size;
+
+        // The copy takes over the offset of the call, which jumps may target
+        std::vector<size_t> offsets(size);
+        for (size_t k = 0; k < size; ++k) {
+            offsets[k] = k == 0 ? offset : next_offset_++;
+        }
+        std::unordered_map<size_t, size_t> renamed;
+        for (size_t k = 1; k < callee_body.size(); ++k) {
+            renamed.emplace(callee_body[k].first, offsets[2 * argc + k - 1]);
+        }
+        Renaming const renaming{.first_local = next_local, .argc = argc, .offsets = renamed};
+        next_local += static_cast<int>(argc + begin->locc());
+
+        std::vector<std::unique_ptr<Instruction>> copy;
+        for (size_t k = argc; k-- > 0;) {
+            auto const arg = renaming.variable({.kind = Location::Arg, .index = static_cast<int>(k)});
+            copy.push_back(std::make_unique<Store>(arg));
+            copy.push_back(std::make_unique<Drop>());
+        }
+        for (auto const& [_, callee_inst] : callee_body | std::views::drop(1)) {
+            if (callee_inst->is_function_exit()) {
+                copy.push_back(std::make_unique<Jump>(static_cast<int>(body[i + 1].first)));
+            } else {
+                copy.push_back(copy_instruction(*callee_inst, renaming));
+            }
+        }
+        for (size_t k = 0; k < size; ++k) {
+            result.emplace_back(offsets[k], copy[k].get());
+            copies_.push_back(std::move(copy[k]));
+        }
+    }
+    return result;
+}
+
+}  // namespace lama
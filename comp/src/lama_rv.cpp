@@ -1,64 +1,189 @@
 #include <glog/logging.h>
+#include <algorithm>
 #include <cstddef>
+#include <fstream>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <optional>
 #include <ostream>
 #include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 #include "bytefile.h"
+#include "escape.h"
+#include "function_ir.h"
+#include "inliner.h"
 #include "inst_reader.h"
 #include "instruction.h"
+#include "layout.h"
+#include "regalloc.h"
+#include "unboxed.h"
+
+struct Options {
+    lama::rv::OutputFormat format = lama::rv::OutputFormat::Asm;
+    // Extensions the generated code may use
+    lama::rv::TargetFeatures target{};
+    bool peephole_stats = false;
+    // Report the code size of each function without and with the C extension
+    bool code_size = false;
+    bool inline_calls = true;
+    // Build objects that do not escape in the frame
+    bool stack_allocate = true;
+    // Keep integers unboxed where the arithmetic on them pays for the boxing
+    bool unbox = true;
+    // Count how often each block runs
+    bool profile_generate = false;
+    // Block counts of an earlier instrumented run, to lay out the blocks by
+    std::optional<lama::rv::Profile> profile{};
+};
 
 void emit(
     std::string_view filename,
     std::map<size_t, std::unique_ptr<lama::Instruction>> const& instructions,
     std::vector<std::string_view>&& strings,
     bytefile const* f,
-    std::ostream& out
+    std::ostream& out,
+    Options const& options
 ) {
     CHECK(!instructions.empty());
-    lama::rv::Compiler c{filename, out, static_cast<size_t>(f->global_area_size), std::move(strings)};
+    lama::rv::Compiler c{
+        filename, out, static_cast<size_t>(f->global_area_size), std::move(strings), options.format, options.target
+    };
+    if (options.code_size) {
+        c.cb.measure_code_size();
+    }
+    c.instrument = options.profile_generate;
     c.header();
-    for (size_t i = 0; i < f->public_symbols_number; ++i) {
-        c.add_jump_target(get_public_offset(f, i), 0);
+    // Functions are compiled one at a time: a function spans from its BEGIN to the next one
+    std::vector<lama::FunctionBody> functions;
+    for (auto const& [offset, inst] : instructions) {
+        if (inst->is_function_entry() || functions.empty()) {
+            functions.emplace_back();
+        }
+        functions.back().emplace_back(offset, inst.get());
     }
-    while (true) {
-        auto todo_it = c.todo.begin();
-        if (todo_it == c.todo.end()) {
-            break;
+    lama::Inliner inliner{functions, instructions.rbegin()->first + 1};
+    // Escape analysis looks into callees, so all functions are built before any is compiled
+    std::vector<lama::FunctionBody> bodies;
+    std::vector<lama::rv::FunctionIR> irs;
+    for (auto const& function : functions) {
+        bodies.push_back(options.inline_calls ? inliner.expand(function) : function);
+        irs.push_back(lama::rv::FunctionIR::build(bodies.back()));
+    }
+    std::vector<std::pair<size_t, lama::rv::FunctionIR const*>> by_offset;
+    for (size_t k = 0; k < irs.size(); ++k) {
+        by_offset.emplace_back(bodies[k].front().first, &irs[k]);
+    }
+    lama::rv::EscapeAnalysis const escape{by_offset};
+    for (auto const& ir : irs) {
+        auto allocation = lama::rv::allocate_registers(ir);
+        if (options.stack_allocate) {
+            lama::rv::place_frame_objects(allocation, ir, escape.frame_objects(ir));
+            for (auto node : escape.shared_strings(ir)) {
+                allocation.shared_strings.insert(node);
+            }
+        }
+        if (options.unbox) {
+            allocation.unboxed = lama::rv::unboxed_integers(ir);
         }
-        size_t const start_offset = todo_it->first;
-        c.st.top = todo_it->second;
-        c.todo.erase(todo_it);
-        if (!c.should_emit(start_offset)) {
-            continue;
+        if (options.target.compressed) {
+            lama::rv::favor_compressible_registers(allocation, ir);
         }
-        for (auto it = instructions.find(start_offset); it != instructions.end(); ++it) {
-            auto const& [offset, inst] = *it;
-            c.inst_begin(offset);
-            c.debug_stack_height();
-            {
-                std::ostringstream disasm;
-                disasm << "-> " << *inst;
-                c.cb.emit_comment(disasm.view());
+        c.ir = &ir;
+        c.allocation = &allocation;
+        auto const order = lama::rv::layout_blocks(ir, options.profile ? &*options.profile : nullptr);
+        for (size_t k = 0; k < order.size(); ++k) {
+            auto const& block = ir.blocks[order[k]];
+            for (size_t i = block.first; i <= block.last; ++i) {
+                auto const& node = ir.nodes[i];
+                // The entry block is counted once BEGIN has set up the function
+                bool const counted = c.instrument && i == block.first;
+                c.begin_instruction(i);
+                if (counted && !node.inst->is_function_entry()) {
+                    c.count_block(ir.nodes[block.first].offset);
+                }
+                {
+                    std::ostringstream disasm;
+                    disasm << "-> " << *node.inst;
+                    c.cb.emit_comment(disasm.view());
+                }
+                node.inst->emit_code(&c);
+                if (counted && node.inst->is_function_entry()) {
+                    c.count_block(ir.nodes[block.first].offset);
+                }
             }
-            inst->emit_code(&c);
-            c.debug_stack_height();
-            if (inst->is_terminator()) {
-                c.cb.emit_comment("============");
-                break;
+            // Blocks that fall through may have been placed apart
+            auto const& last = ir.nodes[block.last];
+            bool const falls_through =
+                !last.inst->is_terminator() && std::ranges::find(last.succs, block.last + 1) != last.succs.end();
+            if (falls_through && (k + 1 == order.size() || ir.blocks[order[k + 1]].first != block.last + 1)) {
+                c.cb.emit_j(c.label_for_ip(ir.nodes[block.last + 1].offset));
             }
+            c.cb.emit_comment("============");
         }
+        c.finish_function();
+        c.ir = nullptr;
+        c.allocation = nullptr;
+    }
+    if (c.instrument) {
+        c.profile_tables();
+    }
+    c.stack_maps();
+    c.cb.flush();
+    if (options.peephole_stats) {
+        std::cerr << c.cb.peephole_stats();
+    }
+    if (options.code_size) {
+        std::cerr << c.cb.code_sizes();
     }
-    out << std::endl;
 }
 
 int main(int argc, char const* argv[]) {
     FLAGS_logtostderr = true;
     google::InitGoogleLogging(argv[0]);
 
-    CHECK_EQ(argc, 2);
-    bytefile* file = read_file(argv[1]);
+    // lama-rv [--emit=asm|obj] [-march=<isa>] [--peephole-stats] [--code-size] [--no-inline]
+    //         [--no-stack-alloc] [--no-unbox] [--profile-generate | --profile-use=<profile>] <file.bc>
+    Options options;
+    char const* input = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view const arg = argv[i];
+        if (arg == "--emit=asm") {
+            options.format = lama::rv::OutputFormat::Asm;
+        } else if (arg == "--emit=obj") {
+            options.format = lama::rv::OutputFormat::Object;
+        } else if (arg.starts_with("-march=")) {
+            options.target = lama::rv::parse_march(arg.substr(arg.find('=') + 1));
+        } else if (arg == "--peephole-stats") {
+            options.peephole_stats = true;
+        } else if (arg == "--code-size") {
+            options.code_size = true;
+        } else if (arg == "--no-inline") {
+            options.inline_calls = false;
+        } else if (arg == "--no-stack-alloc") {
+            options.stack_allocate = false;
+        } else if (arg == "--no-unbox") {
+            options.unbox = false;
+        } else if (arg == "--profile-generate") {
+            options.profile_generate = true;
+        } else if (arg.starts_with("--profile-use=")) {
+            std::ifstream profile{std::string{arg.substr(arg.find('=') + 1)}};
+            CHECK(profile) << "cannot open " << arg.substr(arg.find('=') + 1);
+            options.profile = lama::rv::read_profile(profile);
+        } else if (arg.starts_with("--")) {
+            LOG(FATAL) << "unknown option " << arg;
+        } else {
+            CHECK(input == nullptr) << "more than one input file";
+            input = argv[i];
+        }
+    }
+    CHECK(input != nullptr) << "usage: lama-rv [--emit=asm|obj] [-march=<isa>] [--peephole-stats] [--code-size] "
+                               "[--no-inline] [--no-stack-alloc] [--no-unbox] "
+                               "[--profile-generate | --profile-use=<profile>] <file.bc>";
+    bytefile* file = read_file(input);
     lama::InstReader reader{file};
     std::map<size_t, std::unique_ptr<lama::Instruction>> instructions;
     while (true) {
@@ -70,6 +195,6 @@ int main(int argc, char const* argv[]) {
         auto [_pos, inserted] = instructions.emplace(offset, std::move(inst));
         DCHECK(inserted) << std::format("{:#x}", offset);
     }
-    emit(argv[1], instructions,reader.read_strings(), file, std::cout);
+    emit(input, instructions, reader.read_strings(), file, std::cout, options);
     close_file(file);
 }
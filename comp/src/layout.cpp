@@ -0,0 +1,77 @@
+#include "layout.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <numeric>
+#include <optional>
+#include <string>
+#include "instructions.h"
+
+namespace lama::rv {
+
+Profile read_profile(std::istream& in) {
+    Profile profile;
+    std::string offset;
+    uint64_t count;
+    while (in >> offset >> count) {
+        profile[std::stoull(offset, nullptr, 0)] += count;
+    }
+    CHECK(in.eof()) << "malformed profile";
+    return profile;
+}
+
+std::vector<size_t> layout_blocks(FunctionIR const& ir, Profile const* profile) {
+    std::vector<size_t> order(ir.blocks.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (profile == nullptr) {
+        return order;
+    }
+    auto const count = [&](size_t b) -> uint64_t {
+        auto const it = profile->find(ir.nodes[ir.blocks[b].first].offset);
+        return it == profile->end() ? 0 : it->second;
+    };
+    auto const is_cold = [&](size_t b) {
+        return count(b) == 0 || dynamic_cast<Fail const*>(ir.nodes[ir.blocks[b].last].inst) != nullptr;
+    };
+
+    order.clear();
+    std::vector<bool> placed(ir.blocks.size(), false);
+    auto const place_chain = [&](size_t b) {
+        while (true) {
+            placed[b] = true;
+            order.push_back(b);
+            std::optional<size_t> next;
+            for (auto succ : ir.blocks[b].succs) {
+                if (!placed[succ] && !is_cold(succ) && (!next || count(succ) > count(*next))) {
+                    next = succ;
+                }
+            }
+            if (!next) {
+                return;
+            }
+            b = *next;
+        }
+    };
+    place_chain(0);
+    // Further chains start at the most frequent block left, in reverse postorder on ties
+    while (true) {
+        std::optional<size_t> start;
+        for (auto b : ir.block_order) {
+            if (!placed[b] && !is_cold(b) && (!start || count(b) > count(*start))) {
+                start = b;
+            }
+        }
+        if (!start) {
+            break;
+        }
+        place_chain(*start);
+    }
+    for (size_t b = 0; b < ir.blocks.size(); ++b) {
+        if (!placed[b]) {
+            order.push_back(b);
+        }
+    }
+    return order;
+}
+
+}  // namespace lama::rv
@@ -0,0 +1,180 @@
+#include "peephole.h"
+
+#include <format>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <variant>
+
+namespace lama::rv {
+
+namespace {
+
+bool same(Register a, Register b) {
+    return a.regno == b.regno;
+}
+
+bool fits_imm(int64_t value) {
+    return value >= -2048 && value < 2048;
+}
+
+bool is_stack_adjust(Insn const& insn) {
+    return insn.op == Op::Addi && same(insn.rd, Register::sp()) && same(insn.rs1, Register::sp());
+}
+
+class Peepholer {
+public:
+    Peepholer(std::vector<Item>& items, PeepholeStats& stats)
+        : items_(items)
+        , stats_(stats)
+        , dead_(items.size(), false) {
+        for (auto const& item : items_) {
+            if (auto const* insn = std::get_if<Insn>(&item); insn && !insn->symbol.empty()) {
+                referenced_.insert(insn->symbol);
+            } else if (auto const* global = std::get_if<Global>(&item)) {
+                referenced_.insert(global->name);
+            } else if (auto const* address = std::get_if<DataAddress>(&item)) {
+                referenced_.insert(address->symbol);
+            }
+        }
+    }
+
+    // One pass over the items; returns whether anything changed
+    bool run() {
+        bool changed = false;
+        std::optional<size_t> prev;
+        for (size_t i = 0; i < items_.size(); ++i) {
+            if (is_transparent(items_[i])) {
+                continue;
+            }
+            auto* insn = std::get_if<Insn>(&items_[i]);
+            if (insn == nullptr) {
+                prev.reset();
+                continue;
+            }
+            if (rewrite_single(i, *insn) || (prev && rewrite_pair(*prev, i))) {
+                changed = true;
+            }
+            if (!dead_[i]) {
+                prev = i;
+            } else if (prev && dead_[*prev]) {
+                prev.reset();
+            }
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < items_.size(); ++i) {
+            if (dead_[i]) {
+                continue;
+            }
+            if (kept != i) {
+                items_[kept] = std::move(items_[i]);
+            }
+            ++kept;
+        }
+        items_.resize(kept);
+        return changed;
+    }
+
+private:
+    std::vector<Item>& items_;
+    PeepholeStats& stats_;
+    std::vector<bool> dead_;
+    // Labels nothing refers to cannot be entered other than by falling through
+    std::unordered_set<std::string> referenced_;
+
+    bool is_transparent(Item const& item) const {
+        if (auto const* label = std::get_if<Label>(&item)) {
+            return !referenced_.contains(label->name);
+        }
+        return std::holds_alternative<Comment>(item);
+    }
+
+    Insn& insn(size_t i) {
+        return std::get<Insn>(items_[i]);
+    }
+
+    void kill(size_t i, Peephole p) {
+        dead_[i] = true;
+        stats_.hit(p);
+    }
+
+    bool rewrite_single(size_t i, Insn const& cur) {
+        if ((cur.op == Op::Mv || (cur.op == Op::Addi && cur.imm == 0)) && same(cur.rd, cur.rs1)) {
+            kill(i, Peephole::MoveToSelf);
+            return true;
+        }
+        if (cur.op == Op::J && jumps_to_next(i, cur.symbol)) {
+            kill(i, Peephole::JumpToNext);
+            return true;
+        }
+        return false;
+    }
+
+    bool rewrite_pair(size_t p, size_t i) {
+        auto& first = insn(p);
+        auto& second = insn(i);
+        if (first.op == Op::Mv && second.op == Op::Mv && same(first.rd, second.rs1) && same(first.rs1, second.rd)) {
+            kill(i, Peephole::MoveBack);
+            return true;
+        }
+        if (first.op == Op::Sd && second.op == Op::Ld && same(first.rs1, second.rs1) && first.imm == second.imm) {
+            // The loaded value is still in the register just stored
+            if (same(first.rs2, second.rd)) {
+                kill(i, Peephole::StoreLoad);
+            } else {
+                second = {.op = Op::Mv, .rd = second.rd, .rs1 = first.rs2};
+                stats_.hit(Peephole::StoreLoad);
+            }
+            return true;
+        }
+        if (is_branch(first.op) && second.op == Op::J && jumps_to_next(i, first.symbol)) {
+            // Branch to the jump target on the opposite condition and fall through otherwise
+            first.op = inverted_branch(first.op);
+            first.symbol = second.symbol;
+            kill(i, Peephole::BranchOverJump);
+            return true;
+        }
+        if (is_stack_adjust(first) && is_stack_adjust(second) && fits_imm(first.imm + second.imm)) {
+            first.imm += second.imm;
+            kill(i, Peephole::StackAdjust);
+            if (first.imm == 0) {
+                dead_[p] = true;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool jumps_to_next(size_t i, std::string const& target) const {
+        for (size_t k = i + 1; k < items_.size(); ++k) {
+            if (std::holds_alternative<Comment>(items_[k])) {
+                continue;
+            }
+            auto const* label = std::get_if<Label>(&items_[k]);
+            if (label == nullptr) {
+                return false;
+            }
+            if (label->name == target) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+}  // namespace
+
+std::ostream& operator<<(std::ostream& os, PeepholeStats const& stats) {
+#define PEEPHOLE_PRINT(name, description) \
+    os << std::format("{:<12} {:>8}  {}\n", #name, stats.hits[static_cast<size_t>(Peephole::name)], description);
+    PEEPHOLES(PEEPHOLE_PRINT)
+#undef PEEPHOLE_PRINT
+    return os;
+}
+
+void run_peephole(std::vector<Item>& items, PeepholeStats& stats) {
+    while (Peepholer(items, stats).run()) {
+    }
+}
+
+}  // namespace lama::rv
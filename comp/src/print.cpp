@@ -13,11 +13,12 @@ std::string ip_to_string(size_t ip) {
     return std::format("{:#010x}", ip);
 }
 
-std::string loc_to_string(std::variant<std::string, size_t> const& loc) {
+std::string loc_to_string(lama::rv::Callee const& loc) {
     return std::visit(
         overloads{
             [](size_t ip) { return ip_to_string(ip); },
             [](std::string name) { return name; },
+            [](lama::rv::ClosureCallee) { return std::string{"closure"}; },
         },
         loc
     );
@@ -39,8 +40,8 @@ void SExpression::print(std::ostream& os) const {
     os << "SEXP\t" << _name << " " << _size;
 }
 
-void StoreStack::print(std::ostream&) const {
-    TODO();
+void StoreStack::print(std::ostream& os) const {
+    os << "STI";
 }
 
 void StoreArray::print(std::ostream& os) const {
@@ -67,8 +68,8 @@ void Duplicate::print(std::ostream& os) const {
     os << "DUP";
 }
 
-void Swap::print(std::ostream&) const {
-    TODO();
+void Swap::print(std::ostream& os) const {
+    os << "SWAP";
 }
 
 void Elem::print(std::ostream& os) const {
@@ -0,0 +1,183 @@
+#include "regalloc.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <array>
+
+namespace lama::rv {
+
+namespace {
+
+// s1-s11 (s0 is the frame pointer) and t1-t4 (t0 holds the globals, t5 and t6 are scratch)
+constexpr auto callee_saved_pool = std::to_array<size_t>({9, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27});
+constexpr auto caller_saved_pool = std::to_array<size_t>({6, 7, 28, 29});
+
+// Positions: node `i` reads its operands at 2i and writes its results at 2i + 1
+struct Interval {
+    size_t start{SIZE_MAX};
+    size_t end{0};
+    double cost{};
+    bool crosses_call{};
+
+    void cover(size_t pos) {
+        start = std::min(start, pos);
+        end = std::max(end, pos);
+    }
+
+    double spill_weight() const {
+        return cost / static_cast<double>(end - start + 1);
+    }
+};
+
+std::vector<Interval> build_intervals(FunctionIR const& ir) {
+    std::vector<Interval> intervals(ir.vregs_count);
+    for (size_t i = 0; i < ir.nodes.size(); ++i) {
+        auto const& node = ir.nodes[i];
+        size_t const use_pos = 2 * i, def_pos = 2 * i + 1;
+        double const freq = frequency(node.loop_depth);
+        node.live_in.for_each([&](size_t v) { intervals[v].cover(use_pos); });
+        node.live_out.for_each([&](size_t v) { intervals[v].cover(def_pos); });
+        ir.for_each_use(node, [&](size_t v) {
+            intervals[v].cover(use_pos);
+            intervals[v].cost += freq;
+        });
+        ir.for_each_def(node, [&](size_t v) {
+            intervals[v].cover(def_pos);
+            intervals[v].cost += freq;
+        });
+        if (node.info.callee && node.tail_call == TailCall::None) {
+            VregSet across = node.live_out;
+            ir.for_each_def(node, [&across](size_t v) { across.reset(v); });
+            across.for_each([&](size_t v) { intervals[v].crosses_call = true; });
+        }
+    }
+    return intervals;
+}
+
+}  // namespace
+
+Allocation allocate_registers(FunctionIR const& ir) {
+    auto const intervals = build_intervals(ir);
+
+    // Constants stay symbolic: their users materialize them, mostly as immediates
+    std::vector<size_t> order;
+    for (size_t v = 0; v < ir.vregs_count; ++v) {
+        if (intervals[v].start != SIZE_MAX && !ir.constant(v)) {
+            order.push_back(v);
+        }
+    }
+    std::ranges::stable_sort(order, {}, [&](size_t v) { return intervals[v].start; });
+
+    std::array<bool, 32> is_free{};
+    for (auto r : callee_saved_pool) {
+        is_free[r] = true;
+    }
+    for (auto r : caller_saved_pool) {
+        is_free[r] = true;
+    }
+    auto const take_free = [&is_free](auto const& pool) -> std::optional<size_t> {
+        for (auto r : pool) {
+            if (is_free[r]) {
+                is_free[r] = false;
+                return r;
+            }
+        }
+        return std::nullopt;
+    };
+
+    std::vector<std::optional<size_t>> reg(ir.vregs_count);
+    std::vector<size_t> active, spilled;
+    for (auto cur : order) {
+        auto const& interval = intervals[cur];
+        std::erase_if(active, [&](size_t v) {
+            if (intervals[v].end < interval.start) {
+                is_free[*reg[v]] = true;
+                return true;
+            }
+            return false;
+        });
+
+        auto r = interval.crosses_call ? take_free(callee_saved_pool) : take_free(caller_saved_pool);
+        if (!r) {
+            r = interval.crosses_call ? take_free(caller_saved_pool) : take_free(callee_saved_pool);
+        }
+        if (r) {
+            reg[cur] = r;
+            active.push_back(cur);
+            continue;
+        }
+
+        // Spill the coldest of the competing intervals, preferring the one that lives longer
+        auto const colder = [&](size_t a, size_t b) {
+            double const wa = intervals[a].spill_weight(), wb = intervals[b].spill_weight();
+            return wa < wb || (wa == wb && intervals[a].end > intervals[b].end);
+        };
+        auto victim = std::ranges::min(active, colder);
+        if (!colder(victim, cur)) {
+            spilled.push_back(cur);
+            continue;
+        }
+        reg[cur] = reg[victim];
+        reg[victim] = std::nullopt;
+        spilled.push_back(victim);
+        std::erase(active, victim);
+        active.push_back(cur);
+    }
+
+    Allocation result{
+        .locs = std::vector<SymbolicStack::Loc>(ir.vregs_count, SymbolicStack::Loc::constant(0)),
+        .slots_count = 0,
+        .unboxed = VregSet(ir.vregs_count),
+    };
+    for (size_t v = 0; v < ir.vregs_count; ++v) {
+        if (reg[v]) {
+            result.locs[v] = SymbolicStack::Loc::reg(Register{*reg[v]});
+        } else if (auto value = ir.constant(v)) {
+            result.locs[v] = SymbolicStack::Loc::constant(*value);
+        }
+    }
+
+    // Spilled intervals that do not overlap share frame slots
+    std::ranges::sort(spilled, {}, [&](size_t v) { return intervals[v].start; });
+    std::vector<std::pair<size_t, size_t>> slot_ends;  // slot, end of its last interval
+    for (auto v : spilled) {
+        auto reusable = std::ranges::find_if(slot_ends, [&](auto const& slot) {
+            return slot.second < intervals[v].start;
+        });
+        if (reusable == slot_ends.end()) {
+            slot_ends.emplace_back(++result.slots_count, intervals[v].end);
+            result.locs[v] = SymbolicStack::Loc::slot(result.slots_count);
+        } else {
+            reusable->second = intervals[v].end;
+            result.locs[v] = SymbolicStack::Loc::slot(reusable->first);
+        }
+    }
+    return result;
+}
+
+void favor_compressible_registers(Allocation& allocation, FunctionIR const& ir) {
+    std::array<double, 32> weight{};
+    auto const count = [&](size_t v, double freq) {
+        if (allocation.locs[v].type == SymbolicStack::LocType::Register) {
+            weight[allocation.locs[v].number] += freq;
+        }
+    };
+    for (auto const& node : ir.nodes) {
+        double const freq = frequency(node.loop_depth);
+        ir.for_each_use(node, [&](size_t v) { count(v, freq); });
+        ir.for_each_def(node, [&](size_t v) { count(v, freq); });
+    }
+    // Callee-saved registers are interchangeable, so swapping two of them keeps the allocation valid
+    size_t const compressible = callee_saved_pool.front();
+    size_t const hottest = *std::ranges::max_element(callee_saved_pool, {}, [&weight](size_t r) { return weight[r]; });
+    if (weight[hottest] <= weight[compressible]) {
+        return;
+    }
+    for (auto& loc : allocation.locs) {
+        if (loc.type == SymbolicStack::LocType::Register && (loc.number == hottest || loc.number == compressible)) {
+            loc.number = loc.number == hottest ? compressible : hottest;
+        }
+    }
+}
+
+}  // namespace lama::rv
@@ -0,0 +1,132 @@
+#include "unboxed.h"
+
+#include <algorithm>
+#include <numeric>
+#include <utility>
+#include <vector>
+#include "instructions.h"
+
+namespace lama::rv {
+
+namespace {
+
+// Whether the values the instruction pushes are integers whatever its operands are
+bool yields_integer(Instruction const& inst) {
+    if (auto const* pattern = dynamic_cast<PatternInst const*>(&inst)) {
+        return pattern->type() != Pattern::String;
+    }
+    return dynamic_cast<Binop const*>(&inst) || dynamic_cast<Const const*>(&inst) || dynamic_cast<Tag const*>(&inst) ||
+           dynamic_cast<Array const*>(&inst);
+}
+
+// Whether the instruction needs no boxed operands and can push unboxed results
+bool computes_unboxed(Instruction const& inst) {
+    return dynamic_cast<Binop const*>(&inst) || dynamic_cast<Const const*>(&inst) ||
+           dynamic_cast<ConditionalJump const*>(&inst) || dynamic_cast<Drop const*>(&inst);
+}
+
+// Whether the instruction is faster on unboxed values
+bool prefers_unboxed(Instruction const& inst) {
+    return dynamic_cast<Binop const*>(&inst) || dynamic_cast<ConditionalJump const*>(&inst);
+}
+
+}  // namespace
+
+VregSet unboxed_integers(FunctionIR const& ir) {
+    // Arguments and the closure may be anything; every other vreg is an integer until one of
+    // its definitions may push something else
+    VregSet integer(ir.vregs_count);
+    for (size_t v = 0; v < ir.vregs_count; ++v) {
+        if (!ir.is_variable(v) || ir.variables[v].kind == Location::Local) {
+            integer.set(v);
+        }
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        auto const demote = [&](size_t v) {
+            if (integer[v]) {
+                integer.reset(v);
+                changed = true;
+            }
+        };
+        for (auto const& node : ir.nodes) {
+            if (node.var_read) {
+                if (!integer[*node.var_read]) {
+                    std::ranges::for_each(node.defs, demote);
+                }
+            } else if (node.var_write) {
+                if (!integer[node.uses.front()]) {
+                    demote(*node.var_write);
+                }
+            } else if (!yields_integer(*node.inst)) {
+                ir.for_each_def(node, demote);
+            }
+        }
+    }
+
+    // Constants have no location, their users take whichever form they need
+    VregSet candidate = integer;
+    for (size_t v = 0; v < ir.vregs_count; ++v) {
+        if (ir.constant(v)) {
+            candidate.reset(v);
+        }
+    }
+    auto const reject = [&candidate](size_t v) { candidate.reset(v); };
+    for (auto const& node : ir.nodes) {
+        if (!node.var_read && !node.var_write && !computes_unboxed(*node.inst)) {
+            ir.for_each_use(node, reject);
+            ir.for_each_def(node, reject);
+        }
+    }
+
+    // Vregs that variables copy to each other take the same form
+    std::vector<size_t> parent(ir.vregs_count);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto const find = [&parent](size_t v) {
+        while (parent[v] != v) {
+            v = parent[v] = parent[parent[v]];
+        }
+        return v;
+    };
+    auto const copy_of = [](IrNode const& node) {
+        return node.var_read ? std::pair{*node.var_read, node.defs.front()} : std::pair{node.uses.front(), *node.var_write};
+    };
+    for (auto const& node : ir.nodes) {
+        if (node.var_read || node.var_write) {
+            auto const [from, to] = copy_of(node);
+            if (candidate[from] && candidate[to]) {
+                parent[find(from)] = find(to);
+            }
+        }
+    }
+
+    // Each use or definition by arithmetic saves about an instruction, boxing a copy costs
+    // two and unboxing one
+    std::vector<double> gain(ir.vregs_count, 0.0);
+    for (auto const& node : ir.nodes) {
+        double const freq = frequency(node.loop_depth);
+        if (node.var_read || node.var_write) {
+            auto const [from, to] = copy_of(node);
+            if (candidate[from] != candidate[to]) {
+                gain[find(candidate[from] ? from : to)] -= candidate[from] ? 2 * freq : freq;
+            }
+        } else if (prefers_unboxed(*node.inst)) {
+            auto const add = [&](size_t v) {
+                if (candidate[v]) {
+                    gain[find(v)] += freq;
+                }
+            };
+            ir.for_each_use(node, add);
+            ir.for_each_def(node, add);
+        }
+    }
+    VregSet unboxed(ir.vregs_count);
+    candidate.for_each([&](size_t v) {
+        if (gain[find(v)] > 0) {
+            unboxed.set(v);
+        }
+    });
+    return unboxed;
+}
+
+}  // namespace lama::rv
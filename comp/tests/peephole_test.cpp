@@ -0,0 +1,189 @@
+// Runs the peephole optimizer over small buffers, one per pattern, and checks what it leaves
+#include <glog/logging.h>
+
+#include <sstream>
+#include <string>
+#include <variant>
+#include <vector>
+#include "peephole.h"
+
+namespace {
+
+using namespace lama::rv;
+
+Register const a0 = Register::arg(0);
+Register const a1 = Register::arg(1);
+Register const sp = Register::sp();
+Register const zero = Register::zero();
+
+std::vector<Insn> insns_of(std::vector<Item> const& items) {
+    std::vector<Insn> insns;
+    for (auto const& item : items) {
+        if (auto const* insn = std::get_if<Insn>(&item)) {
+            insns.push_back(*insn);
+        }
+    }
+    return insns;
+}
+
+size_t hits(PeepholeStats const& stats, Peephole p) {
+    return stats.hits[static_cast<size_t>(p)];
+}
+
+void store_load() {
+    // Reloading the register just stored
+    std::vector<Item> items{
+        Insn{.op = Op::Sd, .rs1 = sp, .rs2 = a0, .imm = 8},
+        Insn{.op = Op::Ld, .rd = a0, .rs1 = sp, .imm = 8},
+    };
+    PeepholeStats stats;
+    run_peephole(items, stats);
+    auto insns = insns_of(items);
+    CHECK_EQ(insns.size(), 1);
+    CHECK(insns[0].op == Op::Sd);
+    CHECK_EQ(hits(stats, Peephole::StoreLoad), 1);
+
+    // Loading it into another register
+    items = {
+        Insn{.op = Op::Sd, .rs1 = sp, .rs2 = a0, .imm = 8},
+        Insn{.op = Op::Ld, .rd = a1, .rs1 = sp, .imm = 8},
+    };
+    stats = {};
+    run_peephole(items, stats);
+    insns = insns_of(items);
+    CHECK_EQ(insns.size(), 2);
+    CHECK(insns[1].op == Op::Mv);
+    CHECK_EQ(insns[1].rd.regno, a1.regno);
+    CHECK_EQ(insns[1].rs1.regno, a0.regno);
+    CHECK_EQ(hits(stats, Peephole::StoreLoad), 1);
+
+    // A different slot is left alone
+    items = {
+        Insn{.op = Op::Sd, .rs1 = sp, .rs2 = a0, .imm = 8},
+        Insn{.op = Op::Ld, .rd = a0, .rs1 = sp, .imm = 16},
+    };
+    stats = {};
+    run_peephole(items, stats);
+    CHECK_EQ(insns_of(items).size(), 2);
+    CHECK_EQ(hits(stats, Peephole::StoreLoad), 0);
+}
+
+void branch_over_jump() {
+    std::vector<Item> items{
+        Insn{.op = Op::Beq, .rs1 = a0, .rs2 = zero, .symbol = "next"},
+        Insn{.op = Op::J, .symbol = "target"},
+        Label{"next"},
+        Insn{.op = Op::Addi, .rd = a0, .rs1 = a0, .imm = 1},
+        Label{"target"},
+    };
+    PeepholeStats stats;
+    run_peephole(items, stats);
+    auto const insns = insns_of(items);
+    CHECK_EQ(insns.size(), 2);
+    CHECK(insns[0].op == Op::Bne);
+    CHECK_EQ(insns[0].symbol, "target");
+    CHECK_EQ(hits(stats, Peephole::BranchOverJump), 1);
+}
+
+void stack_adjust() {
+    // Adjustments that cancel out disappear
+    std::vector<Item> items{
+        Insn{.op = Op::Addi, .rd = sp, .rs1 = sp, .imm = -16},
+        Insn{.op = Op::Addi, .rd = sp, .rs1 = sp, .imm = 16},
+    };
+    PeepholeStats stats;
+    run_peephole(items, stats);
+    CHECK(insns_of(items).empty());
+    CHECK_EQ(hits(stats, Peephole::StackAdjust), 1);
+
+    // Others merge while the sum fits an immediate
+    items = {
+        Insn{.op = Op::Addi, .rd = sp, .rs1 = sp, .imm = -16},
+        Insn{.op = Op::Addi, .rd = sp, .rs1 = sp, .imm = -32},
+        Insn{.op = Op::Addi, .rd = sp, .rs1 = sp, .imm = -2040},
+    };
+    stats = {};
+    run_peephole(items, stats);
+    auto const insns = insns_of(items);
+    CHECK_EQ(insns.size(), 2);
+    CHECK_EQ(insns[0].imm, -48);
+    CHECK_EQ(insns[1].imm, -2040);
+    CHECK_EQ(hits(stats, Peephole::StackAdjust), 1);
+}
+
+void unreferenced_labels() {
+    // Nothing jumps to `inner`, so the store and load still meet
+    std::vector<Item> items{
+        Insn{.op = Op::Sd, .rs1 = sp, .rs2 = a0, .imm = 8},
+        Label{"inner"},
+        Comment{"reload"},
+        Insn{.op = Op::Ld, .rd = a0, .rs1 = sp, .imm = 8},
+    };
+    PeepholeStats stats;
+    run_peephole(items, stats);
+    CHECK_EQ(insns_of(items).size(), 1);
+    CHECK_EQ(hits(stats, Peephole::StoreLoad), 1);
+
+    // Control may enter at a label that is jumped to
+    items = {
+        Insn{.op = Op::Sd, .rs1 = sp, .rs2 = a0, .imm = 8},
+        Label{"inner"},
+        Insn{.op = Op::Ld, .rd = a0, .rs1 = sp, .imm = 8},
+        Insn{.op = Op::Bne, .rs1 = a0, .rs2 = zero, .symbol = "inner"},
+    };
+    stats = {};
+    run_peephole(items, stats);
+    CHECK_EQ(insns_of(items).size(), 3);
+    CHECK_EQ(hits(stats, Peephole::StoreLoad), 0);
+}
+
+void stats_report() {
+    std::vector<Item> items{
+        Insn{.op = Op::Mv, .rd = a0, .rs1 = a0},
+        Insn{.op = Op::Addi, .rd = sp, .rs1 = sp, .imm = -16},
+        Insn{.op = Op::Addi, .rd = sp, .rs1 = sp, .imm = -16},
+        Insn{.op = Op::Sd, .rs1 = sp, .rs2 = a0, .imm = 0},
+        Insn{.op = Op::Ld, .rd = a0, .rs1 = sp, .imm = 0},
+        Insn{.op = Op::J, .symbol = "end"},
+        Label{"end"},
+    };
+    PeepholeStats stats;
+    run_peephole(items, stats);
+    CHECK_EQ(hits(stats, Peephole::MoveToSelf), 1);
+    CHECK_EQ(hits(stats, Peephole::StackAdjust), 1);
+    CHECK_EQ(hits(stats, Peephole::StoreLoad), 1);
+    CHECK_EQ(hits(stats, Peephole::JumpToNext), 1);
+    CHECK_EQ(hits(stats, Peephole::MoveBack), 0);
+
+    // What --peephole-stats prints: a line per pattern with its count
+    std::ostringstream report;
+    report << stats;
+    std::istringstream lines{report.str()};
+    std::vector<std::pair<std::string, size_t>> counts;
+    std::string line;
+    while (std::getline(lines, line)) {
+        std::istringstream fields{line};
+        std::string name;
+        size_t count{};
+        fields >> name >> count;
+        counts.emplace_back(name, count);
+    }
+    std::vector<std::pair<std::string, size_t>> const expected{
+        {"MoveToSelf", 1}, {"MoveBack", 0},   {"StoreLoad", 1},
+        {"StackAdjust", 1}, {"JumpToNext", 1}, {"BranchOverJump", 0},
+    };
+    CHECK(counts == expected) << report.str();
+}
+
+}  // namespace
+
+int main(int, char const* argv[]) {
+    FLAGS_logtostderr = true;
+    google::InitGoogleLogging(argv[0]);
+    store_load();
+    branch_over_jump();
+    stack_adjust();
+    unreferenced_labels();
+    stats_report();
+    return 0;
+}
@@ -21,6 +21,7 @@
           lamac
           gcc
           clang-tools
+          llvm
           cmake
           gdb
           glog
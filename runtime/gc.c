@@ -25,6 +25,14 @@ size_t cur_id = 0;
 static extra_roots_pool extra_roots;
 
 size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
+// Return address of the call into the runtime that set __gc_stack_top
+size_t __gc_stack_ra = 0;
+
+// Stack maps emitted by lama-rv: __gc_stack_maps holds the number of call sites, then the
+// return address of each, in increasing order, and the offset of its frame descriptor in
+// __gc_frame_descriptors. Without them the stack is scanned conservatively.
+extern const size_t __gc_stack_maps[] __attribute__((weak));
+extern const aint   __gc_frame_descriptors[] __attribute__((weak));
 #ifdef LAMA_ENV
 #ifdef __linux__
 extern const size_t __start_custom_data, __stop_custom_data;
@@ -34,11 +42,8 @@ extern const size_t __stop_custom_data __asm("section$end$__DATA$custom_data");
 #endif
 #endif
 
-#ifdef DEBUG_VERSION
+// Not static: compiled code bumps heap.current inline and calls in only when the chunk is full
 memory_chunk heap;
-#else
-static memory_chunk heap;
-#endif
 
 #ifdef DEBUG_VERSION
 void dump_heap ();
@@ -240,12 +245,64 @@ void *gc_alloc (size_t size) {
   return gc_alloc_on_existing_heap(size);
 }
 
-static void gc_root_scan_stack () {
-  for (size_t *p = (size_t *)(__gc_stack_top + sizeof(size_t)); p < (size_t *)__gc_stack_bottom; ++p) {
-    gc_test_and_mark_root((size_t **)p);
+static const aint *find_frame_descriptor (size_t ra) {
+  size_t lo = 0, hi = __gc_stack_maps[0];
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    size_t key = __gc_stack_maps[1 + 2 * mid];
+    if (key == ra) { return __gc_frame_descriptors + __gc_stack_maps[2 + 2 * mid]; }
+    if (key < ra) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
+  return NULL;
+}
+
+// Registers saved at `p`, as `offset << 8 | regno` after their count, from `sp`; returns
+// what follows them
+static const aint *note_saved_registers (const aint *p, size_t sp, size_t **where) {
+  for (aint n = *p++; n > 0; --n, ++p) { where[*p & 0xff] = (size_t *)(sp + (*p >> 8)); }
+  return p;
 }
 
+// Calls `visit` on every stack word that holds a Lama value. With stack maps the frames are
+// walked from the call into the runtime up to the bottom of the stack, following where each
+// frame and the calls in it saved the registers; only the live values are visited. Stacks
+// the maps do not describe are scanned word by word.
+static void gc_for_each_stack_root (void (*visit) (size_t *root, void *arg), void *arg) {
+  size_t       *where[32] = {NULL};
+  size_t        sp        = __gc_stack_top;
+  size_t        ra        = __gc_stack_ra;
+  const aint   *d         = NULL;
+  if (__gc_stack_maps != NULL && sp != 0) { d = find_frame_descriptor(ra); }
+  if (d == NULL) {
+    for (size_t *p = (size_t *)(__gc_stack_top + sizeof(size_t)); p < (size_t *)__gc_stack_bottom; ++p) {
+      visit(p, arg);
+    }
+    return;
+  }
+  for (; d != NULL && sp < __gc_stack_bottom; d = find_frame_descriptor(ra)) {
+    const aint *p = note_saved_registers(d + 3, sp, where);
+    for (int r = 0; r < 32; ++r) {
+      if ((d[2] >> r) & 1) {
+        assert(where[r] != NULL);
+        visit(where[r], arg);
+      }
+    }
+    // The registers saved by the prologue hold the values of the caller
+    p = note_saved_registers(p, sp, where);
+    for (aint n = *p++; n > 0; --n, ++p) { visit((size_t *)(sp + *p), arg); }
+    ra = *(size_t *)(sp + d[1]);
+    sp += d[0];
+  }
+}
+
+static void mark_root (size_t *root, void *arg) { gc_test_and_mark_root((size_t **)root); }
+
+static void gc_root_scan_stack () { gc_for_each_stack_root(mark_root, NULL); }
+
 void mark_phase (void) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "marking has started\n");
@@ -327,23 +384,26 @@ size_t compute_locations () {
   return free_ptr - heap.begin;
 }
 
+static void fix_root (size_t *ptr, void *arg) {
+  memory_chunk *old_heap  = arg;
+  size_t        ptr_value = *ptr;
+  // this can't be expressed via is_valid_heap_pointer, because this pointer may point area corresponding to the old
+  // heap
+  if (is_valid_pointer((size_t *)ptr_value) && (size_t)old_heap->begin <= ptr_value
+      && ptr_value <= (size_t)old_heap->current) {
+    void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
+    void *new_addr =
+        (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
+    size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
+    *(void **)ptr         = new_addr + content_offset;
+  }
+}
+
 void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC scan_and_fix_region started\n");
 #endif
-  for (size_t *ptr = (size_t *)start; ptr < (size_t *)end; ++ptr) {
-    size_t ptr_value = *ptr;
-    // this can't be expressed via is_valid_heap_pointer, because this pointer may point area corresponding to the old
-    // heap
-    if (is_valid_pointer((size_t *)ptr_value) && (size_t)old_heap->begin <= ptr_value
-        && ptr_value <= (size_t)old_heap->current) {
-      void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
-      void *new_addr =
-          (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
-      size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
-    }
-  }
+  for (size_t *ptr = (size_t *)start; ptr < (size_t *)end; ++ptr) { fix_root(ptr, old_heap); }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC scan_and_fix_region finished\n");
 #endif
@@ -460,7 +520,7 @@ void update_references (memory_chunk *old_heap) {
     heap_next_obj_iterator(&it);
   }
   // fix pointers from stack
-  scan_and_fix_region(old_heap, (void *)__gc_stack_top + sizeof(size_t), (void *)__gc_stack_bottom + sizeof(size_t));
+  gc_for_each_stack_root(fix_root, old_heap);
 
   // fix pointers from extra_roots
   scan_and_fix_region_roots(old_heap);
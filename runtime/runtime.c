@@ -5,12 +5,17 @@
 # include "runtime.h"
 # include "gc.h"
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern size_t __gc_stack_top, __gc_stack_bottom, __gc_stack_ra;
 
+// The frame address is sp of the caller at the call, which with the return address is
+// where the collector starts walking the stack maps
 #define PRE_GC()                                                                                   \
   bool flag = false;                                                                               \
   flag      = __gc_stack_top == 0;                                                                 \
-  if (flag) { __gc_stack_top = (size_t)__builtin_frame_address(0); }                               \
+  if (flag) {                                                                                      \
+    __gc_stack_top = (size_t)__builtin_frame_address(0);                                           \
+    __gc_stack_ra  = (size_t)__builtin_return_address(0);                                          \
+  }                                                                                                \
   assert(__gc_stack_top != 0);                                                                     \
   assert((__gc_stack_top & 0xF) == 0);                                                             \
   assert(__builtin_frame_address(0) <= (void *)__gc_stack_top);
@@ -828,6 +833,19 @@ extern void *Bclosure (aint* args, aint bn) {
   return r->contents;
 }
 
+/* Closure of BOX(bn) captured values with the code pointer in place; the compiled code
+   stores the values, so that they need no roots while the collector runs */
+extern void *RVBclosure (void *code, aint bn) {
+  data *r;
+
+  PRE_GC();
+  r = (data *)alloc_closure(UNBOX(bn) + 1);
+  ((void **)r->contents)[0] = code;
+  POST_GC();
+
+  return r->contents;
+}
+
 
 extern void *Barray (aint* args, aint bn) {
   data   *r;
@@ -1363,3 +1381,29 @@ extern void set_args (aint argc, char *argv[]) {
 
   push_extra_root((void **)&global_sysargs);
 }
+
+/* Block profile of a program compiled with --profile-generate: `table` holds the number of
+   counted blocks followed by their bytecode offsets, `counts` how often each one ran. The
+   profile is written at exit to the file named by LAMA_PROFILE, or to lama.profile. */
+static aint *profile_table  = NULL;
+static aint *profile_counts = NULL;
+
+static void profile_dump (void) {
+  char *name = getenv("LAMA_PROFILE");
+  FILE *f    = fopen(name == NULL ? "lama.profile" : name, "w");
+
+  if (f == NULL) {
+    perror("ERROR: profile_dump: fopen failed");
+    return;
+  }
+  for (aint i = 0; i < profile_table[0]; i++) {
+    fprintf(f, "%#lx %ld\n", (long)profile_table[i + 1], (long)profile_counts[i]);
+  }
+  fclose(f);
+}
+
+extern void __profile_start (aint *table, aint *counts) {
+  profile_table  = table;
+  profile_counts = counts;
+  atexit(profile_dump);
+}